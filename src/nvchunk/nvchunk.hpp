@@ -13,10 +13,30 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <string.h>
 #include <iostream>
 #include <random>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <future>
+#include <system_error>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/mempolicy.h>
+#include <linux/fs.h>
 #include "cpmem.hpp"
 
 namespace NVCHUNK {
@@ -35,6 +55,26 @@ namespace NVCHUNK {
 #define GB (0x1<<30)
 #endif
 
+#define NV_CACHELINE    64      // flush granularity of persistent memory
+#define NV_MSYNC_GAP    16      // clean pages bridged to merge two msync runs
+#define NV_DIRTY_BITS   (1 << 24)   // most bits of a chunk's dirty bitmap
+
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC 0x80000
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 template <class T>
 class Singleton
 {
@@ -87,265 +127,4075 @@ inline std::string uuid() {
 using std::string;
 
 /**
- * @brief an nv_dev object represents a mapped NVM device
- *        an NVM device can be either:
- *        1. a file based device
- *           a) a file on a regular file system
- *           b) a file on a dax file system (backed by fsdax NVDIMM or Optane)
- *           c) a devdax device (e.g. /dev/dax0.0)
- *        2. a memory based device
+ * @brief base page size of the system
  */
-class nv_dev {
-protected:
-    string    mName;             // name of this backing device
-    size_t    mSize;             // size of dev
-    void*     mVA;               // virtual address mapped
-    int       mIsPmem;           // is the backing device an NVM device?
-public:
-    size_t         size () const { return mSize; }
-    const string & name () const { return mName; }
-    void*          va   () const { return mVA;   }
+inline size_t nv_pagesize() {
+    static const size_t pgsz = ::sysconf(_SC_PAGESIZE);
+    return pgsz;
+}
 
-    static nv_dev* open(const string & name, size_t size = 0, bool create = false);
-    virtual bool close() = 0;
+/**
+ * @brief a range of a mapping to persist
+ */
+struct nv_range {
+    void*   addr;
+    size_t  size;
+};
 
-    nv_dev(string name = "", size_t size=0) 
-        : mName(name),mSize(size),mVA(nullptr),mIsPmem(false) {}
-    virtual ~nv_dev() {}
+/**
+ * @brief round ranges out to gran, then sort and merge ranges that 
+ *        overlap, touch, or are at most gap bytes apart
+ * 
+ * @param ranges the ranges, coalesced in place
+ * @param gran   power of 2 granularity
+ * @param gap    largest gap bridged between two ranges
+ */
+inline void nv_coalesce(std::vector<nv_range> & ranges, size_t gran, size_t gap = 0) {
+    for (auto & r : ranges) {
+        uintptr_t b = (uintptr_t)r.addr & ~(gran - 1);
+        uintptr_t e = ((uintptr_t)r.addr + r.size + gran - 1) & ~(gran - 1);
+        r.addr = (void*)b;
+        r.size = e - b;
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const nv_range & a, const nv_range & b) {
+        return a.addr < b.addr;
+    });
+
+    size_t n = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (!ranges[i].size) {
+            continue;
+        }
+        if (n) {
+            nv_range & last = ranges[n - 1];
+            uintptr_t  end  = (uintptr_t)last.addr + last.size;
+            if ((uintptr_t)ranges[i].addr <= end + gap) {
+                uintptr_t e = (uintptr_t)ranges[i].addr + ranges[i].size;
+                if (e > end) {
+                    last.size = e - (uintptr_t)last.addr;
+                }
+                continue;
+            }
+        }
+        ranges[n++] = ranges[i];
+    }
+    ranges.resize(n);
+}
+
+/**
+ * @brief epoch based reclamation, defers freeing objects unlinked from
+ *        shared structures until no reader can still hold them
+ *        readers enter an epoch around their reads (see nv_ebr::guard),
+ *        writers unlink an object then retire() it, the object is freed
+ *        once the global epoch has advanced twice past its retirement
+ *        retired objects are freed by a reclaimer thread, off the 
+ *        threads that retire them
+ * 
+ */
+class nv_ebr : public Singleton<nv_ebr> {
+    struct record {
+        std::atomic<uint64_t>   epoch;      // epoch entered, 0 if quiescent
+        std::atomic<bool>       used;       // owned by a live thread
+        unsigned                nest;       // nested guards of the owner
+        record*                 next;
+    };
+    struct owner {
+        record* rec = nullptr;
+        ~owner() {
+            if( rec ) {
+                rec->epoch.store(0, std::memory_order_release);
+                rec->used.store(false, std::memory_order_release);
+            }
+        }
+    };
+    struct limbo {
+        uint64_t                epoch;      // epoch retired in
+        std::function<void()>   free;
+    };
+
+    std::atomic<uint64_t>   mEpoch;         // global epoch
+    std::atomic<record*>    mRecords;       // records of all threads, never freed
+    std::mutex              mLock;          // protects mLimbo
+    std::deque<limbo>       mLimbo;         // retired, not freed yet
+    std::condition_variable mCond;          // signals retired objects
+    std::thread             mThread;        // the reclaimer thread
+    bool                    mStop;
 
     /**
-     * @brief persist the data of the whole range
+     * @brief the record of the calling thread, records of exited threads
+     *        are reused
+     */
+    record* local() {
+        static thread_local owner o;
+        if( o.rec ) {
+            return o.rec;
+        }
+        for( record* r = mRecords.load(std::memory_order_acquire); r; r = r->next ) {
+            bool f = false;
+            if( !r->used.load(std::memory_order_relaxed) && 
+                 r->used.compare_exchange_strong(f, true) ) {
+                o.rec = r;
+                return r;
+            }
+        }
+        record* r = new record;
+        r->epoch.store(0, std::memory_order_relaxed);
+        r->used.store(true, std::memory_order_relaxed);
+        r->nest = 0;
+        r->next = mRecords.load(std::memory_order_relaxed);
+        while( !mRecords.compare_exchange_weak(r->next, r) );
+        o.rec = r;
+        return r;
+    }
+
+    /**
+     * @brief advance the global epoch if every active thread has 
+     *        entered the current one
      * 
-     * @return int 0 if succ, else -1 with errno set
+     * @return uint64_t the global epoch after trying
      */
-    virtual int flush(void* addr = nullptr, size_t size = 0) = 0;
+    uint64_t advance() {
+        uint64_t e = mEpoch.load();
+        for( record* r = mRecords.load(std::memory_order_acquire); r; r = r->next ) {
+            uint64_t le = r->epoch.load();
+            if( le && le != e ) {
+                return e;
+            }
+        }
+        mEpoch.compare_exchange_strong(e, e + 1);
+        return mEpoch.load();
+    }
 
-    virtual bool is_pmem(bool retest = false) {
-        return retest ? pmem_is_pmem(mVA, mSize) : mIsPmem;
+    /**
+     * @brief free objects retired two epochs ago, with mLock held
+     * 
+     * @return uint64_t the global epoch they were freed in
+     */
+    uint64_t collect(std::unique_lock<std::mutex> & lk) {
+        uint64_t e = advance();
+        std::vector<std::function<void()>> done;
+        while( !mLimbo.empty() && mLimbo.front().epoch + 2 <= e ) {
+            done.push_back(std::move(mLimbo.front().free));
+            mLimbo.pop_front();
+        }
+        lk.unlock();
+        for( auto & f : done ) {
+            f();
+        }
+        lk.lock();
+        return e;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(mLock);
+        while (true) {
+            mCond.wait(lk, [this] { return mStop || !mLimbo.empty(); });
+            if (mStop) {
+                return;
+            }
+            collect(lk);
+            if (!mLimbo.empty()) {
+                /* readers still hold older epochs, retry shortly */
+                mCond.wait_for(lk, std::chrono::milliseconds(1), [this] { return mStop; });
+            }
+        }
+    }
+
+public:
+    nv_ebr() : mEpoch(1), mRecords(nullptr), mStop(false) {}
+
+    ~nv_ebr() {
+        {
+            std::lock_guard<std::mutex> lk(mLock);
+            mStop = true;
+        }
+        mCond.notify_all();
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    /**
+     * @brief a reader critical section, objects reached inside it are
+     *        not freed before it ends, guards may nest
+     * 
+     */
+    class guard {
+    public:
+        guard()  { nv_ebr::instance().enter(); }
+        ~guard() { nv_ebr::instance().exit(); }
+        guard(const guard &)            = delete;
+        void operator=(const guard &)   = delete;
+    };
+
+    void enter() {
+        record* r = local();
+        if( r->nest++ == 0 ) {
+            r->epoch.store(mEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void exit() {
+        record* r = local();
+        if( --r->nest == 0 ) {
+            r->epoch.store(0, std::memory_order_release);
+        }
     }
 
-    void zero() {
-        ::pmem_memset(mVA, 0, mSize, 0);
+    /**
+     * @brief free an object once no reader can hold it any more, the
+     *        object must be unlinked from shared structures already
+     * 
+     * @param free frees the object
+     */
+    void retire(std::function<void()> free) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> lk(mLock);
+        if( !mThread.joinable() ) {
+            mThread = std::thread(&nv_ebr::run, this);
+        }
+        mLimbo.push_back({ mEpoch.load(), std::move(free) });
+        mCond.notify_one();
     }
-    void zero(void* addr, size_t size) {
-        ::pmem_memset(addr, 0, size, 0);
+
+    /**
+     * @brief wait until everything retired so far is freed
+     *        must not be called inside a guard
+     */
+    void synchronize() {
+        std::unique_lock<std::mutex> lk(mLock);
+        uint64_t target = mEpoch.load() + 2;
+        for( ;; ) {
+            if( collect(lk) >= target ) {
+                break;
+            }
+            lk.unlock();
+            std::this_thread::yield();
+            lk.lock();
+        }
     }
 
+    /**
+     * @brief number of objects retired but not freed yet
+     */
+    size_t pending() {
+        std::lock_guard<std::mutex> lk(mLock);
+        return mLimbo.size();
+    }
 };
 
 /**
- * @brief an nv_filedev is an nv_dev backed by a file
- *        the backing file can be a file on dax file system
- *        or a DAX raw device or a file on a regular file system
+ * @brief group commit of flushes from many threads
+ *        threads register ranges into the current epoch, the first 
+ *        thread of an epoch becomes its leader: it waits for the batching
+ *        window to pass (or for the epoch to collect enough bytes) and
+ *        for the previous epoch to finish, then flushes all ranges of
+ *        the epoch at once and releases every thread waiting on it
  * 
  */
-class nv_filedev : public nv_dev {
+class nv_groupcommit {
+public:
+    typedef std::function<int(std::vector<nv_range> &)> flusher;
+
+private:
+GTEST_ONLY(public:)
+    struct epoch {
+        std::vector<nv_range> ranges;
+        size_t  bytes;
+        bool    done;
+        int     result;
+        int     err;
+        epoch() : bytes(0), done(false), result(0), err(0) {}
+    };
+
+    flusher                     mFlush;
+    std::mutex                  mLock;
+    std::condition_variable     mCond;
+    std::shared_ptr<epoch>      mCurrent;       // the epoch taking ranges
+    bool                        mLeader;        // mCurrent has a leader
+    bool                        mFlushing;      // an epoch is being flushed
+    std::chrono::microseconds   mWindow;        // batching window
+    size_t                      mMaxBytes;      // flush once an epoch has this much
+    uint64_t                    mEpochs;        // epochs flushed
+
 public:
+    nv_groupcommit(const flusher & f) 
+        : mFlush(f), mCurrent(std::make_shared<epoch>()), mLeader(false), 
+          mFlushing(false), mWindow(100), mMaxBytes(MB), mEpochs(0) {}
+
     /**
-     * @brief Construct a new nvm device object with file type backing device
-     *        - Open if backing device file already exists
-     *        - Create if backing device file does not exist
+     * @brief configure the batching window
      * 
-     * @param name the path to nvm device file
-     * @param size size of the backing file for creation
+     * @param window   longest time a leader waits for more ranges
+     * @param maxbytes an epoch is flushed early once it has this many bytes
      */
-    nv_filedev(string path, size_t size=0, bool create=false) : nv_dev(path, size)
-    {
-        struct stat st;
-        size_t mapped_len   = 0;
-        int    is_pmem      = 0;
-        int    flags        = 0;
+    void configure(std::chrono::microseconds window, size_t maxbytes) {
+        std::lock_guard<std::mutex> lk(mLock);
+        mWindow   = window;
+        mMaxBytes = maxbytes;
+    }
 
-        if (create && size <= 0) {
-            throw nv_exception("creating file with zero size.");
-        }
+    uint64_t nepochs() {
+        std::lock_guard<std::mutex> lk(mLock);
+        return mEpochs;
+    }
 
-        if( stat(mName.c_str(), &st) != 0 ) {
-            /* backing file doesn't not exist, create and map with given size */
-            if(!size) {
-                throw nv_exception("new file with zero size.");
+    /**
+     * @brief register a range into the current epoch and wait until the
+     *        epoch is flushed
+     * 
+     * @return int result of the epoch's flush, 0 or -1 with errno set
+     */
+    int commit(void* addr, size_t size) {
+        std::unique_lock<std::mutex> lk(mLock);
+        std::shared_ptr<epoch> e = mCurrent;
+        e->ranges.push_back({ addr, size });
+        e->bytes += size;
+
+        if (mLeader) {
+            if (e->bytes >= mMaxBytes) {
+                mCond.notify_all();
             }
-            flags |= PMEM_FILE_CREATE;
-            mSize = size;
+            mCond.wait(lk, [&e] { return e->done; });
+            errno = e->err;
+            return e->result;
         }
-        else {
-            if (create) {
-                /* backing file exists, apply new size if create */
-                if ( ::truncate (mName.c_str(), size) != 0 ) {
-                    throw nv_exception( std::string("failed to apply new size to file .") + mName );
+
+        /* lead the epoch */
+        mLeader = true;
+        auto deadline = std::chrono::steady_clock::now() + mWindow;
+        mCond.wait_until(lk, deadline, [this, &e] { return e->bytes >= mMaxBytes; });
+        mCond.wait(lk, [this] { return !mFlushing; });
+        mCurrent  = std::make_shared<epoch>();
+        mLeader   = false;
+        mFlushing = true;
+        lk.unlock();
+
+        int rt = mFlush(e->ranges);
+        int err = rt ? errno : 0;
+
+        lk.lock();
+        e->result = rt;
+        e->err    = err;
+        e->done   = true;
+        mFlushing = false;
+        mEpochs++;
+        mCond.notify_all();
+        errno = err;
+        return rt;
+    }
+};
+
+#define NV_WARM_SLICE   (4 * MB)    // readahead issued at a time by a warm-up
+
+/**
+ * @brief a warm-up reads ranges of a mapping ahead in the background, 
+ *        slice by slice, so that the first accesses don't wait for the
+ *        backing device, see nv_dev::warmup()
+ *        the reader doesn't refer to the nv_dev, a warm-up may outlive it
+ *        the worker owns the state of the warm-up and runs to the end
+ *        even if every handle is dropped, only cancel() stops it
+ * 
+ */
+class nv_warmup {
+public:
+    typedef std::function<int(void*, size_t)> reader;
+
+private:
+GTEST_ONLY(public:)
+    struct state {
+        reader                  read;           // reads a slice ahead
+        std::vector<nv_range>   ranges;         // ranges to warm up
+        size_t                  total;          // bytes to warm up
+        std::atomic<size_t>     done;           // bytes warmed up so far
+        std::atomic<bool>       cancel;         // stop at the next slice
+        std::atomic<bool>       finished;       // the worker is done
+        int                     result;         // 0, or -1 with err
+        int                     err;
+        std::mutex              lock;           // protects finished for wait()
+        std::condition_variable cond;           // signals finished
+
+        state(const reader & rd, const std::vector<nv_range> & rs)
+            : read(rd), ranges(rs), total(0), done(0), cancel(false),
+              finished(false), result(0), err(0) {}
+    };
+    std::shared_ptr<state>  mState;             // shared with the worker
+
+    static void finish(state & s, int err) {
+        std::lock_guard<std::mutex> lk(s.lock);
+        s.err    = err;
+        s.result = err ? -1 : 0;
+        s.finished.store(true);
+        s.cond.notify_all();
+    }
+
+    static void run(std::shared_ptr<state> s) {
+        for (auto & r : s->ranges) {
+            for (size_t off = 0; off < r.size; off += NV_WARM_SLICE) {
+                if (s->cancel.load()) {
+                    finish(*s, ECANCELED);
+                    return;
                 }
-                mSize = size;
-            }
-            else {
-                /* backing file exists, just map the whole file if no create */
-                mSize = st.st_size;
-                size  = 0;   // zero size for while file mmapping
+                size_t len = std::min((size_t)NV_WARM_SLICE, r.size - off);
+                if (s->read((char*)r.addr + off, len) != 0) {
+                    finish(*s, errno ? errno : EIO);
+                    return;
+                }
+                s->done += len;
             }
         }
+        finish(*s, 0);
+    }
 
-        if((mVA = (void*)pmem_map_file(mName.c_str(), size, flags, 0666, &mapped_len, &is_pmem)) == nullptr) {
-            throw nv_exception("failed to map device.");
+public:
+    nv_warmup(const reader & rd, const std::vector<nv_range> & ranges) 
+        : mState(std::make_shared<state>(rd, ranges))
+    {
+        for (auto & r : mState->ranges) {
+            mState->total += r.size;
         }
+        std::thread(&nv_warmup::run, mState).detach();
+    }
 
-        if(mapped_len != mSize) {
-            throw nv_exception("partial mapped device.");
-        }
+    /**
+     * @brief bytes to warm up, and bytes warmed up so far
+     */
+    size_t total() const    { return mState->total; }
+    size_t progress() const { return mState->done.load(); }
 
-        mIsPmem = pmem_is_pmem(mVA, mSize);
-    }
+    /**
+     * @brief whether the warm-up finished, was cancelled or failed
+     */
+    bool done() const { return mState->finished.load(); }
 
-    virtual bool close() override {
-        if(mVA && mSize && pmem_unmap(mVA, mSize)) {
-            return false;
-        }
-        mVA   = nullptr;
-        mSize = 0;
-        return true;
-    }
+    /**
+     * @brief stop the warm-up after the slice being read
+     */
+    void cancel() { mState->cancel.store(true); }
 
     /**
-     * @brief flush data onto persistent memory
-     *        calling pmem_persist for NVM devices (NVDIMM, Optane)
-     *        calling pmem_msync for regular file based devices
-     *
-     * @param addr the starting address to flush
-     * @param size size of data to flush
-     * @return int 0 if succ, else -1 and errno tells why
+     * @brief wait for the warm-up to end
+     * 
+     * @return int 0 if all ranges were read ahead, else -1 with errno set
+     *             ECANCELED if cancelled
      */
-    virtual int flush(void* addr = 0, size_t size = 0) override { 
-        int rt = 0;
-        if( mIsPmem ) {
-            (addr && size) ? pmem_persist(addr, size) : 
-                             pmem_persist(mVA, mSize);
+    int wait() {
+        std::unique_lock<std::mutex> lk(mState->lock);
+        mState->cond.wait(lk, [this] { return mState->finished.load(); });
+        errno = mState->err;
+        return mState->result;
+    }
+};
+
+/**
+ * @brief hugepage policy of a memory based nv_dev
+ *        explicit hugetlb policies fall back to transparent hugepages,
+ *        and then to base pages if no hugepage can be obtained
+ */
+enum nv_hugepage {
+    NV_HUGEPAGE_NONE = 0,       // base pages only
+    NV_HUGEPAGE_THP,            // transparent hugepages, madvise(MADV_HUGEPAGE)
+    NV_HUGEPAGE_2M,             // MAP_HUGETLB with 2M pages
+    NV_HUGEPAGE_1G,             // MAP_HUGETLB with 1G pages
+};
+
+/**
+ * @brief how nv_dev::zero() clears a range
+ * 
+ */
+enum nv_zero {
+    NV_ZERO_AUTO = 0,           // pick the cheapest for the device and size
+    NV_ZERO_MEMSET,             // memset from the calling thread
+    NV_ZERO_NT,                 // non-temporal stores from a pool of threads
+    NV_ZERO_FALLOCATE,          // fallocate(FALLOC_FL_ZERO_RANGE), or punch
+                                // a hole, on file devices
+};
+
+#define NV_ZERO_SLICE   (4 * MB)    // smallest range zeroed by one thread
+
+/**
+ * @brief how an nv_dev maps its backing file
+ * 
+ */
+enum nv_openmode {
+    NV_OPEN_RDWR = 0,           // read-write, shared with the file
+    NV_OPEN_RDONLY,             // read-only, shared with the file
+    NV_OPEN_COW,                // private copy-on-write, writes never reach
+                                // the file
+};
+
+/**
+ * @brief expected access pattern of a range, see nv_dev::advise()
+ * 
+ */
+enum nv_advice {
+    NV_ADVISE_NORMAL = 0,       // default readahead
+    NV_ADVISE_SEQUENTIAL,       // scans: aggressive readahead, pages freed
+                                // soon after they are read
+    NV_ADVISE_RANDOM,           // lookups: no readahead
+};
+
+/**
+ * @brief how to prefault the mapping of an nv_dev on open
+ * 
+ */
+enum nv_prefault {
+    NV_PREFAULT_NONE = 0,       // fault pages in lazily on first access
+    NV_PREFAULT_POPULATE,       // madvise(MADV_POPULATE_READ/WRITE)
+    NV_PREFAULT_TOUCH,          // touch every page
+};
+
+/**
+ * @brief how the blocks of a file based nv_dev are allocated when the
+ *        file is created, resized or grown
+ * 
+ */
+enum nv_alloc {
+    NV_ALLOC_SPARSE = 0,        // ftruncate, blocks are allocated on first write
+    NV_ALLOC_FALLOCATE,         // posix_fallocate all blocks up front
+};
+
+/**
+ * @brief options to open an nv_dev
+ * 
+ */
+struct nv_devopts {
+    nv_hugepage hugepage;       // hugepage policy for memory based devices
+    int      numa_node;         // bind the mapping to this node, -1 for none
+    uint64_t numa_interleave;   // interleave the mapping over this node mask
+    nv_prefault prefault;       // prefault the mapping on open
+    unsigned prefault_threads;  // threads to prefault with, 0 for all cpus
+    size_t   reserve;           // address space reserved for nv_dev::grow()
+    bool     shared;            // memory based devices: back with a memfd
+                                // that can be passed to other processes
+    bool     seal;              // seal the size of a shared memory device
+    nv_openmode mode;           // file based devices: how the file is mapped
+    nv_alloc alloc;             // file based devices: block allocation policy
+    size_t   alloc_align;       // file based devices: extent size hint of a
+                                // new file, e.g. 2M for PMD faults on fsdax
+    bool     lazy;              // file based devices: map on first use of
+                                // va(), see nv_lazymap
+
+    nv_devopts() : hugepage(NV_HUGEPAGE_NONE), numa_node(-1), numa_interleave(0),
+                   prefault(NV_PREFAULT_NONE), prefault_threads(0), reserve(0),
+                   shared(false), seal(false), mode(NV_OPEN_RDWR), 
+                   alloc(NV_ALLOC_SPARSE), alloc_align(0), lazy(false) {}
+};
+
+/**
+ * @brief split [0, n) into nthreads contiguous slices and run fn(begin, end)
+ *        on each of them in parallel, the caller runs the last slice
+ * 
+ * @param n        number of items
+ * @param nthreads number of threads, 0 for all cpus
+ * @param fn       the worker
+ */
+inline void nv_parallel_for(size_t n, unsigned nthreads, 
+                            const std::function<void(size_t, size_t)> & fn) {
+    if (!nthreads) {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (nthreads > n) {
+        nthreads = n ? n : 1;
+    }
+
+    std::vector<std::thread> workers;
+    size_t slice = n / nthreads;
+    size_t begin = 0;
+    for (unsigned i = 0; i + 1 < nthreads; i++, begin += slice) {
+        workers.emplace_back(fn, begin, begin + slice);
+    }
+    fn(begin, n);
+    for (auto & t : workers) {
+        t.join();
+    }
+}
+
+#define NV_COPY_SLICE   (16 * MB)   // smallest range copied by one thread
+
+/**
+ * @brief copy [off, off+len) of a file to the beginning of another one
+ *        the range is cloned with FICLONE/FICLONERANGE on file systems
+ *        that share extents (XFS, btrfs), whatever can't be cloned is
+ *        copied with copy_file_range by nthreads threads, or with
+ *        pread/pwrite if the kernel can't copy between the files
+ * 
+ * @param sfd      the source file
+ * @param off      offset of the range in the source file
+ * @param dfd      the destination file, truncated to len
+ * @param len      length of the range
+ * @param nthreads number of threads, 0 for all cpus
+ * @return int 0 if succ, else -1 with errno set
+ */
+inline int nv_clone_range(int sfd, off_t off, int dfd, size_t len, unsigned nthreads = 0) {
+    struct stat st;
+    if (::fstat(sfd, &st) != 0) {
+        return -1;
+    }
+    if (off < 0 || (size_t)off + len > (size_t)st.st_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* clone whole blocks, a range that ends at EOF needn't be aligned */
+    size_t blk  = st.st_blksize > 0 ? st.st_blksize : nv_pagesize();
+    size_t done = 0;
+    if (!off && len == (size_t)st.st_size && ::ioctl(dfd, FICLONE, sfd) == 0) {
+        return 0;
+    }
+    if (off % blk == 0) {
+        struct file_clone_range r;
+        r.src_fd      = sfd;
+        r.src_offset  = off;
+        r.src_length  = (size_t)off + len == (size_t)st.st_size ? len : len & ~(blk - 1);
+        r.dest_offset = 0;
+        if (r.src_length && ::ioctl(dfd, FICLONERANGE, &r) == 0) {
+            done = r.src_length;
+        }
+    }
+    if (::ftruncate(dfd, len) != 0) {
+        return -1;
+    }
+    if (done == len) {
+        return 0;
+    }
+
+    std::atomic<int> err(0);
+    size_t rest    = len - done;
+    size_t nslices = std::max((size_t)1, rest / NV_COPY_SLICE);
+    size_t slice   = (rest / nslices) & ~(blk - 1);
+    nv_parallel_for(nslices, nthreads ? std::min((size_t)nthreads, nslices) : 0,
+                    [&](size_t b, size_t e) {
+        loff_t spos = off + done + b * slice;
+        loff_t dpos = done + b * slice;
+        size_t n  = e == nslices ? rest - b * slice : (e - b) * slice;
+        std::vector<char> buf;
+        while (n && !err.load()) {
+            ssize_t rt = ::copy_file_range(sfd, &spos, dfd, &dpos, n, 0);
+            if (rt < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || 
+                           errno == EINVAL)) {
+                /* copy through user space */
+                buf.resize(std::min(n, (size_t)MB));
+                rt = ::pread(sfd, buf.data(), std::min(n, buf.size()), spos);
+                if (rt > 0 && ::pwrite(dfd, buf.data(), rt, dpos) != rt) {
+                    rt = -1;
+                }
+                spos += rt > 0 ? rt : 0;
+                dpos += rt > 0 ? rt : 0;
+            }
+            if (rt <= 0) {
+                err.store(rt < 0 ? errno : EIO);
+                return;
+            }
+            n -= rt;
+        }
+    });
+    if (err.load()) {
+        errno = err.load();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief mask of the online NUMA nodes, node 0 only if it can't be told
+ * 
+ */
+inline uint64_t nv_numa_online() {
+    uint64_t mask = 0;
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (f) {
+        int lo, hi;
+        /* the list looks like "0" or "0-1,4-5" */
+        while (fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &hi) != 1) break;
+                c = fgetc(f);
+            }
+            for (int n = lo; n <= hi && n < 64; n++) {
+                mask |= 1ull << n;
+            }
+            if (c != ',') break;
+        }
+        fclose(f);
+    }
+    return mask ? mask : 1;
+}
+
+/**
+ * @brief bind a mapped range onto a set of NUMA nodes
+ *        nodes that are not online are dropped from the mask
+ * 
+ * @param addr       page aligned starting address
+ * @param len        length of the range
+ * @param mask       mask of the nodes
+ * @param interleave interleave pages across the nodes instead of binding
+ * @return uint64_t  the mask that was actually applied, 0 if not bound
+ */
+inline uint64_t nv_numa_bind(void* addr, size_t len, uint64_t mask, bool interleave) {
+    mask &= nv_numa_online();
+    if (!mask) {
+        return 0;
+    }
+    if (::syscall(SYS_mbind, addr, len, interleave ? MPOL_INTERLEAVE : MPOL_BIND,
+                  &mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE) != 0) {
+        return 0;
+    }
+    return mask;
+}
+
+/**
+ * @brief apply a NUMA policy to the calling thread while the object 
+ *        lives, the pages it allocates meanwhile, page cache included,
+ *        are placed on the nodes
+ *        nodes that are not online are dropped from the mask
+ */
+class nv_numa_scope {
+    int         mMode;          // policy to restore
+    uint64_t    mMask;
+    bool        mSet;
+public:
+    nv_numa_scope(uint64_t mask, bool interleave) : mMode(MPOL_DEFAULT), mMask(0), mSet(false) {
+        mask &= nv_numa_online();
+        if (mask && ::syscall(SYS_get_mempolicy, &mMode, &mMask, sizeof(mMask) * 8 + 1, 0, 0) == 0) {
+            mSet = ::syscall(SYS_set_mempolicy, interleave ? MPOL_INTERLEAVE : MPOL_BIND,
+                             &mask, sizeof(mask) * 8 + 1) == 0;
+        }
+    }
+    ~nv_numa_scope() {
+        if (mSet) {
+            ::syscall(SYS_set_mempolicy, mMode, mMode == MPOL_DEFAULT ? nullptr : &mMask,
+                      sizeof(mMask) * 8 + 1);
+        }
+    }
+    nv_numa_scope(const nv_numa_scope &) = delete;
+    nv_numa_scope & operator=(const nv_numa_scope &) = delete;
+};
+
+class nv_dev;
+class nvchunk;
+
+/**
+ * @brief a chunk containing an address, and the offset of the address
+ *        within the chunk, see NVM::resolve()
+ */
+struct nv_resolved {
+    nvchunk*    chunk;          // nullptr if no chunk contains the address
+    size_t      offset;
+};
+
+/**
+ * @brief ordered index from addresses to the chunks mapped over them
+ *        devices are ordered by the address they are mapped at, the
+ *        chunks of a device are kept sorted by offset in layers of 
+ *        chunks that don't overlap, a chunk goes to the first layer it 
+ *        fits in, so there are as many layers as chunks nest (e.g. two
+ *        for a chunk of the whole device and chunks within it)
+ *        a lookup is a binary search per layer under a shared lock, 
+ *        adding and removing chunks update the layers in place under 
+ *        the exclusive lock
+ *        devices report their mapping as it changes (see 
+ *        nv_dev::remapped()), devices of no indexed chunk are ignored
+ * 
+ */
+class nv_addrindex : public Singleton<nv_addrindex> {
+    struct chunkent {
+        size_t      end;
+        nvchunk*    chunk;
+    };
+    struct layer {
+        std::vector<size_t>   offs;     // sorted offsets of the chunks
+        std::vector<chunkent> ents;     // the chunks, in the same order
+    };
+    struct devent {
+        uintptr_t   va;         // 0 if not mapped
+        size_t      size;
+        size_t      nlive;      // chunks indexed
+        std::vector<layer> layers;
+    };
+    pthread_rwlock_t                    mLock;
+    std::map<const nv_dev*, devent>     mDevs;
+    std::map<uintptr_t, devent*>        mRanges;    // by va, mapped only
+
+    /**
+     * @brief whether [off, end) overlaps no chunk of a layer
+     * 
+     * @param pos where off would be inserted
+     */
+    static bool fits(const layer & l, size_t pos, size_t off, size_t end) {
+        return (pos == 0 || l.ents[pos - 1].end <= off) &&
+               (pos == l.offs.size() || end <= l.offs[pos]);
+    }
+
+public:
+    nv_addrindex() { pthread_rwlock_init(&mLock, nullptr); }
+    ~nv_addrindex() { pthread_rwlock_destroy(&mLock); }
+
+    /**
+     * @brief index a chunk of a device
+     * 
+     * @param chunk the chunk
+     * @param dev   its device
+     * @param off   offset of the chunk in the device
+     * @param len   size of the chunk
+     */
+    void add(nvchunk* chunk, const nv_dev* dev, size_t off, size_t len);
+
+    /**
+     * @brief drop a chunk, and its device with its last chunk
+     * 
+     * @param off offset of the chunk in the device, as added
+     */
+    void remove(nvchunk* chunk, const nv_dev* dev, size_t off) {
+        pthread_rwlock_wrlock(&mLock);
+        auto d = mDevs.find(dev);
+        if (d != mDevs.end()) {
+            devent & de = d->second;
+            for (auto l = de.layers.begin(); l != de.layers.end(); l++) {
+                size_t pos = std::lower_bound(l->offs.begin(), l->offs.end(), off) - l->offs.begin();
+                while (pos < l->offs.size() && l->offs[pos] == off && l->ents[pos].chunk != chunk) {
+                    pos++;
+                }
+                if (pos == l->offs.size() || l->offs[pos] != off) {
+                    continue;
+                }
+                l->offs.erase(l->offs.begin() + pos);
+                l->ents.erase(l->ents.begin() + pos);
+                if (l->offs.empty()) {
+                    de.layers.erase(l);
+                }
+                if (--de.nlive == 0) {
+                    if (de.va) {
+                        mRanges.erase(de.va);
+                    }
+                    mDevs.erase(d);
+                }
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&mLock);
+    }
+
+    /**
+     * @brief a device was mapped, unmapped, moved or resized
+     * 
+     * @param va   where it is mapped now, nullptr if not mapped
+     */
+    void update(const nv_dev* dev, void* va, size_t size) {
+        pthread_rwlock_wrlock(&mLock);
+        auto d = mDevs.find(dev);
+        if (d != mDevs.end()) {
+            devent & de = d->second;
+            if (de.va) {
+                mRanges.erase(de.va);
+            }
+            de.va   = (uintptr_t)va;
+            de.size = va ? size : 0;
+            if (de.va) {
+                mRanges[de.va] = &de;
+            }
+        }
+        pthread_rwlock_unlock(&mLock);
+    }
+
+    /**
+     * @brief find the chunk containing an address, of overlapping chunks
+     *        the one starting last before the address
+     */
+    nv_resolved find(const void* addr) {
+        nv_resolved res{ nullptr, 0 };
+        uintptr_t   a = (uintptr_t)addr;
+
+        pthread_rwlock_rdlock(&mLock);
+        auto r = mRanges.upper_bound(a);
+        if (r != mRanges.begin()) {
+            const devent & de = *(--r)->second;
+            if (a < de.va + de.size) {
+                size_t o = a - de.va;
+                for (auto & l : de.layers) {
+                    size_t pos = std::upper_bound(l.offs.begin(), l.offs.end(), o) - l.offs.begin();
+                    if (pos-- == 0 || o >= l.ents[pos].end) {
+                        continue;
+                    }
+                    if (!res.chunk || o - l.offs[pos] < res.offset) {
+                        res.chunk  = l.ents[pos].chunk;
+                        res.offset = o - l.offs[pos];
+                    }
+                }
+            }
+        }
+        pthread_rwlock_unlock(&mLock);
+        return res;
+    }
+
+    size_t nchunks() {
+        size_t n = 0;
+        pthread_rwlock_rdlock(&mLock);
+        for (auto & d : mDevs) {
+            n += d.second.nlive;
+        }
+        pthread_rwlock_unlock(&mLock);
+        return n;
+    }
+};
+
+/**
+ * @brief an nv_dev object represents a mapped NVM device
+ *        an NVM device can be either:
+ *        1. a file based device
+ *           a) a file on a regular file system
+ *           b) a file on a dax file system (backed by fsdax NVDIMM or Optane)
+ *           c) a devdax device (e.g. /dev/dax0.0)
+ *        2. a memory based device
+ */
+class nv_lazymap;
+class nv_dev {
+    friend class nv_lazymap;
+    friend class nv_addrindex;
+protected:
+    string    mName;             // name of this backing device
+    size_t    mSize;             // size of dev
+    void*     mVA;               // virtual address mapped
+    int       mIsPmem;           // is the backing device an NVM device?
+    size_t    mPageSize;         // page size backing the mapping
+    nv_hugepage mHugePage;       // hugepage policy actually obtained
+    uint64_t  mNumaMask;         // NUMA nodes the mapping is bound to
+    uint64_t  mTouchMask;        // NUMA nodes prefault places pages on,
+                                 // if mbind() can't bind the mapping
+    bool      mTouchInterleave;
+    std::chrono::nanoseconds mPrefaultTime;  // time spent on the last prefault
+    nv_openmode mMode;           // how the backing device is mapped
+    std::atomic<long> mRefs;     // the opener's and one per chunk
+
+    bool                   mLazy;       // mapped on first use of va()
+    std::atomic<bool>      mMapped;     // lazy: the mapping is in place
+    mutable std::atomic<bool> mRef;     // lazy: used since the last LRU scan
+    std::mutex             mMapLock;    // lazy: serializes map and unmap
+    size_t                 mPins;       // lazy: pins, protected by mMapLock
+
+    /**
+     * @brief map a lazy device, unmap it again
+     *        only devices that support lazy mapping override them
+     * 
+     * @return true if succ, else false with errno set
+     */
+    virtual bool map_lazy()   { errno = ENOTSUP; return false; }
+    virtual bool unmap_lazy() { errno = ENOTSUP; return false; }
+
+    /**
+     * @brief va() of a lazy device, maps it if needed
+     */
+    void* map_va();
+
+    /**
+     * @brief report the mapping to nv_addrindex, called whenever the
+     *        device is mapped, unmapped or resized
+     */
+    void remapped() {
+        nv_addrindex::instance().update(this, is_mapped() ? mVA : nullptr, mSize);
+    }
+
+    /**
+     * @brief whether prefault must fault pages in writable
+     *        (read faults map the shared zero page on private memory)
+     */
+    virtual bool prefault_write() const { return false; }
+
+    /**
+     * @brief give the pages of a page aligned range back to the backing
+     *        device, the range reads as zeros afterwards
+     *        devices that can't give pages back zero them
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int discard_pages(void* addr, size_t len) {
+        return zero(addr, len);
+    }
+
+    /**
+     * @brief the reader of a warm-up of the mapping, 
+     *        MADV_WILLNEED by default
+     */
+    virtual nv_warmup::reader warm_reader() {
+        size_t pg = mPageSize;
+        return [pg](void* addr, size_t len) {
+            uintptr_t b = (uintptr_t)addr & ~(pg - 1);
+            return ::madvise((void*)b, (uintptr_t)addr + len - b, MADV_WILLNEED);
+        };
+    }
+
+    std::atomic<uint64_t> mSyncs;       // drains and msyncs issued
+    std::mutex            mPendLock;    // protects mPending
+    std::vector<nv_range> mPending;     // ranges flushed without drain (msync devices)
+    nv_groupcommit        mGroup;       // group commit of flushes
+
+    struct nv_hint {
+        size_t    off;          // offset of the range
+        size_t    len;          // length of the range, 0 up to the end
+        nv_advice how;
+    };
+    std::mutex            mHintLock;    // protects mHints
+    std::vector<nv_hint>  mHints;       // access patterns, oldest first
+
+    /**
+     * @brief madvise the pages covering [off, off+len) of the mapping
+     */
+    int madvise_range(size_t off, size_t len, nv_advice how) {
+        static const int advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM };
+        uintptr_t pg = mPageSize;
+        uintptr_t b  = ((uintptr_t)mVA + off) & ~(pg - 1);
+        uintptr_t e  = ((uintptr_t)mVA + off + len + pg - 1) & ~(pg - 1);
+        return ::madvise((void*)b, e - b, advice[how]);
+    }
+
+    /**
+     * @brief reapply the access patterns onto [off, off+len) of the 
+     *        mapping after it was (re)mapped
+     */
+    void apply_hints(size_t off, size_t len) {
+        std::lock_guard<std::mutex> lk(mHintLock);
+        for (auto & h : mHints) {
+            size_t b = std::max(h.off, off);
+            size_t e = std::min(h.len ? h.off + h.len : mSize, off + len);
+            if (b < e) {
+                madvise_range(b, e - b, h.how);
+            }
+        }
+    }
+
+    /**
+     * @brief persist a range of the mapping, the whole mapping if 
+     *        addr or size is 0
+     *
+     * @return int 0 if succ, else -1 and errno tells why
+     */
+    int persist(void* addr, size_t size) {
+        pinned pin(this);
+        std::vector<nv_range> ranges(1);
+        ranges[0].addr = (addr && size) ? addr : pin.va();
+        ranges[0].size = (addr && size) ? size : mSize;
+        return ranges[0].addr ? persistv(ranges) : -1;
+    }
+
+    /**
+     * @brief persist a batch of ranges of the mapping
+     *        NVM devices (NVDIMM, Optane): flush the cache lines of all
+     *        ranges with pmem_flush then issue a single pmem_drain
+     *        regular file based devices: msync each run of pages once,
+     *        runs only a few clean pages apart are merged
+     *
+     * @param ranges ranges to persist, coalesced in place
+     * @return int 0 if succ, else -1 and errno tells why
+     */
+    int persistv(std::vector<nv_range> & ranges) {
+        if( !writable() ) {
+            errno = EROFS;
+            return -1;
+        }
+        if( mIsPmem ) {
+            nv_coalesce(ranges, NV_CACHELINE);
+            for (auto & r : ranges) {
+                pmem_flush(r.addr, r.size);
+            }
+            pmem_drain();
+            mSyncs++;
+            return 0;
+        }
+
+        nv_coalesce(ranges, nv_pagesize(), NV_MSYNC_GAP * nv_pagesize());
+        for (auto & r : ranges) {
+            mSyncs++;
+            if (pmem_msync(r.addr, r.size) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief whether mbind() places the pages of the mapping, it
+     *        doesn't place the page cache of a shared file mapping
+     */
+    virtual bool numa_mbind() const { return true; }
+
+    /**
+     * @brief apply the NUMA policy in opts onto the mapping
+     *        the mapping is left unbound if none of the nodes is online
+     *        a mapping mbind() can't bind is left unbound too, prefault
+     *        places the pages it faults in on the nodes instead
+     */
+    void numa_bind(void* addr, size_t len, const nv_devopts & opts) {
+        uint64_t mask = opts.numa_interleave ? opts.numa_interleave :
+                        opts.numa_node >= 0 && opts.numa_node < 64 ? 1ull << opts.numa_node : 0;
+        if (!mask) {
+            return;
+        }
+        if (!numa_mbind()) {
+            mTouchMask       = mask;
+            mTouchInterleave = opts.numa_interleave != 0;
+            return;
+        }
+        mNumaMask = nv_numa_bind(addr, len, mask, opts.numa_interleave != 0);
+    }
+
+    /**
+     * @brief whether writes may reach the backing device
+     */
+    bool writable() const { return mMode == NV_OPEN_RDWR; }
+public:
+    size_t         size () const { return mSize; }
+    const string & name () const { return mName; }
+
+    /**
+     * @brief the address of the mapping
+     *        a lazy device (nv_devopts::lazy) is mapped by the first call,
+     *        nullptr with errno set if that fails
+     *        a lazy device may be unmapped again by nv_lazymap and then
+     *        mapped elsewhere, va() and pointers into the mapping are 
+     *        only stable while the device is pinned, see pin()
+     */
+    void* va() const { 
+        return mLazy ? const_cast<nv_dev*>(this)->map_va() : mVA; 
+    }
+
+    /**
+     * @brief keep a lazy device mapped until unpin(), pins nest
+     * 
+     * @return void* va(), nullptr with errno set if the device can't be mapped
+     */
+    void* pin() {
+        if (!mLazy) {
+            return mVA;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mMapLock);
+            mPins++;
+        }
+        void* va = map_va();
+        if (!va) {
+            unpin();
+        }
+        return va;
+    }
+    void unpin() {
+        if (mLazy) {
+            std::lock_guard<std::mutex> lk(mMapLock);
+            mPins--;
+        }
+    }
+
+    /**
+     * @brief pin() for the lifetime of the guard
+     */
+    class pinned {
+        nv_dev* mDev;
+        void*   mAddr;
+    public:
+        explicit pinned(nv_dev* dev) : mDev(dev), mAddr(dev->pin()) {}
+        ~pinned() {
+            if (mAddr) {
+                mDev->unpin();
+            }
+        }
+        pinned(const pinned &) = delete;
+        pinned & operator=(const pinned &) = delete;
+
+        /**
+         * @brief va() of the device, nullptr with errno set if it can't
+         *        be mapped
+         */
+        void* va() const { return mAddr; }
+    };
+
+    /**
+     * @brief take a reference to the device, each chunk holds one
+     *        a device found by name must be reached and referenced in
+     *        the same nv_ebr::guard, it may be closed meanwhile
+     * 
+     * @return true if taken, false if the last reference is gone and 
+     *         the device is about to be freed
+     */
+    bool get() {
+        long n = mRefs.load(std::memory_order_relaxed);
+        do {
+            if (n == 0) {
+                return false;
+            }
+        } while (!mRefs.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    /**
+     * @brief drop a reference, the opener holds the first one
+     *        after the last one is dropped, the device is closed and freed
+     *        by nv_ebr's reclaimer once no thread in an nv_ebr::guard can
+     *        still reach it, so it's never unmapped under a reader
+     *        a device may only be deleted directly while no chunk holds it
+     */
+    void put() {
+        if (mRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            nv_dev* d = this;
+            nv_ebr::instance().retire([d]() { delete d; });
+        }
+    }
+
+    long refs() const { return mRefs.load(); }
+
+    /**
+     * @brief whether the device is mapped, false for a lazy device until
+     *        va() is called or after nv_lazymap unmapped it
+     */
+    bool is_mapped() const { return mLazy ? mMapped.load() : mVA != nullptr; }
+    bool is_lazy() const { return mLazy; }
+
+    /**
+     * @brief the page size that actually backs the mapping
+     *        (base page size if no hugepage was obtained)
+     */
+    size_t      pagesize () const { return mPageSize; }
+    nv_hugepage hugepage () const { return mHugePage; }
+    nv_openmode mode     () const { return mMode; }
+
+    /**
+     * @brief time spent on the last prefault of the mapping
+     */
+    std::chrono::nanoseconds prefault_time() const { return mPrefaultTime; }
+
+    /**
+     * @brief fault in all pages of the mapping, the range is split
+     *        among nthreads threads
+     *        NV_PREFAULT_POPULATE falls back to touching pages if the
+     *        kernel doesn't support MADV_POPULATE_READ/WRITE
+     * 
+     * @param mode     NV_PREFAULT_POPULATE or NV_PREFAULT_TOUCH
+     * @param nthreads number of threads, 0 for all cpus
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int prefault(nv_prefault mode, unsigned nthreads = 0) {
+        if (mode == NV_PREFAULT_NONE) {
+            return 0;
+        }
+        pinned pin(this);
+        return prefault((char*)pin.va(), mode, nthreads);
+    }
+
+protected:
+    /**
+     * @brief prefault() the mapping at base, for the mapping paths 
+     *        that can't pin the device (nv_filedev::map_lazy() runs 
+     *        with the map lock held)
+     */
+    int prefault(char* base, nv_prefault mode, unsigned nthreads) {
+        if (mode == NV_PREFAULT_NONE) {
+            return 0;
+        }
+        if (!base || !mSize) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* transparent hugepages may be split or not all be huge, 
+           every base page is touched */
+        size_t pg     = mHugePage == NV_HUGEPAGE_THP ? nv_pagesize() : mPageSize;
+        auto   start  = std::chrono::steady_clock::now();
+        size_t npages = (mSize + pg - 1) / pg;
+        bool   write  = prefault_write();
+        std::atomic<int> err(0);
+
+        nv_parallel_for(npages, nthreads, [&](size_t b, size_t e) {
+            nv_numa_scope numa(mTouchMask, mTouchInterleave);
+            char*  p   = base + b * pg;
+            size_t len = std::min(e * pg, mSize) - b * pg;
+            if (mode == NV_PREFAULT_POPULATE &&
+                ::madvise(p, len, write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0) {
+                return;
+            }
+            if (mode == NV_PREFAULT_POPULATE && errno != EINVAL) {
+                err.store(errno);
+                return;
+            }
+            for (size_t off = 0; off < len; off += pg) {
+                volatile char* v = p + off;
+                if (write) {
+                    *v = *v;
+                } else {
+                    (void)*v;
+                }
+            }
+        });
+
+        mPrefaultTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start);
+        if (err.load()) {
+            errno = err.load();
+            return -1;
+        }
+        return 0;
+    }
+
+public:
+    /**
+     * @brief mask of the NUMA nodes the mapping is bound to, 0 if unbound
+     *        file devices are never bound, see numa_bind()
+     */
+    uint64_t    numa_mask() const { return mNumaMask; }
+
+    /**
+     * @brief tell which NUMA node the resident pages of a range live on
+     *        large ranges are sampled
+     * 
+     * @return int the node holding most of the sampled pages, 
+     *             -1 if no page is resident or the query is unsupported
+     */
+    int numa_node(void* addr = nullptr, size_t size = 0) const {
+        const size_t nsamples = 4096;
+
+        if (!addr || !size) {
+            addr = mVA;
+            size = mSize;
+        }
+        if (!addr || !size) {
+            return -1;
+        }
+
+        uintptr_t start = (uintptr_t)addr & ~(mPageSize - 1);
+        size_t    npages = ((uintptr_t)addr + size - start + mPageSize - 1) / mPageSize;
+        size_t    stride = (npages + nsamples - 1) / nsamples;
+        std::vector<void*> pages;
+        for (size_t i = 0; i < npages; i += stride) {
+            pages.push_back((void*)(start + i * mPageSize));
+        }
+        std::vector<int> status(pages.size(), -1);
+        if (::syscall(SYS_move_pages, 0, pages.size(), pages.data(),
+                      NULL, status.data(), 0) != 0) {
+            return -1;
+        }
+
+        std::map<int, size_t> count;
+        int    node = -1;
+        size_t most = 0;
+        for (int st : status) {
+            if (st >= 0 && ++count[st] > most) {
+                most = count[st];
+                node = st;
+            }
+        }
+        return node;
+    }
+
+    static nv_dev* open(const string & name, size_t size = 0, bool create = false,
+                        const nv_devopts & opts = nv_devopts());
+    virtual bool close() = 0;
+
+    nv_dev(string name = "", size_t size=0) 
+        : mName(name),mSize(size),mVA(nullptr),mIsPmem(false),
+          mPageSize(::sysconf(_SC_PAGESIZE)),mHugePage(NV_HUGEPAGE_NONE),
+          mNumaMask(0),mTouchMask(0),mTouchInterleave(false),mPrefaultTime(0),mMode(NV_OPEN_RDWR),mRefs(1),mLazy(false),
+          mMapped(false),mRef(false),mPins(0),mSyncs(0),
+          mGroup([this](std::vector<nv_range> & r) { return flushv(r); }) {}
+    virtual ~nv_dev() {}
+
+    /**
+     * @brief persist the data of the whole range
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int flush(void* addr = nullptr, size_t size = 0) = 0;
+
+    /**
+     * @brief grow the device in place, the mapping stays at va()
+     *        so pointers into the device remain valid
+     * 
+     * @param new_size new size of the device
+     * @return int 0 if succ, else -1 with errno set
+     *             ENOTSUP if the device can't grow in place
+     */
+    virtual int grow(size_t new_size) {
+        UNUSED(new_size);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /**
+     * @brief copy a range of the device into a new file at a point in time
+     * 
+     * @param dest     path of the copy, replaced if it exists
+     * @param off      offset of the range
+     * @param len      length of the range, 0 up to the end of the device
+     * @param nthreads number of threads to copy with, 0 for all cpus
+     * @return int 0 if succ, else -1 with errno set
+     *             ENOTSUP if the device isn't backed by a file
+     */
+    virtual int snapshot(const string & dest, size_t off = 0, size_t len = 0,
+                         unsigned nthreads = 0) {
+        UNUSED(dest);
+        UNUSED(off);
+        UNUSED(len);
+        UNUSED(nthreads);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /**
+     * @brief persist a batch of ranges with one drain (or one msync per
+     *        run of pages), ranges may overlap and needn't be aligned
+     * 
+     * @param ranges ranges to persist, coalesced in place
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int flushv(std::vector<nv_range> & ranges) {
+        return persistv(ranges);
+    }
+
+    /**
+     * @brief flush a range as part of a group commit: ranges from all
+     *        threads calling group_flush() within the batching window are
+     *        flushed together by one of them and all of them return when
+     *        the merged flush is done
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int group_flush(void* addr, size_t size) {
+        return mGroup.commit(addr, size);
+    }
+
+    /**
+     * @brief configure the group commit of group_flush()
+     * 
+     * @param window   longest time to wait for more threads, 100us by default
+     * @param maxbytes flush early once this many bytes are waiting, 1MB by default
+     */
+    void set_group_commit(std::chrono::microseconds window, size_t maxbytes) {
+        mGroup.configure(window, maxbytes);
+    }
+
+    /**
+     * @brief number of group commits flushed so far
+     */
+    uint64_t ngroupcommits() { return mGroup.nepochs(); }
+
+    /**
+     * @brief number of drains and msyncs issued by flushes so far
+     */
+    uint64_t nsyncs() const { return mSyncs.load(); }
+
+    /**
+     * @brief first half of flush(): write back a range without waiting 
+     *        for it to be durable, drain() completes all of them at once
+     *        NVM devices: flush the cache lines, drain() fences, both 
+     *        must be called from the same thread
+     *        regular file based devices: queue the range, drain() msyncs
+     *        the queued ranges coalesced
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int flush_nodrain(void* addr, size_t size) {
+        if (!is_persistent()) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        if (mIsPmem) {
+            pmem_flush(addr, size);
+            return 0;
+        }
+        std::lock_guard<std::mutex> lk(mPendLock);
+        mPending.push_back({ addr, size });
+        return 0;
+    }
+
+    /**
+     * @brief second half of flush(): wait until the ranges passed to 
+     *        flush_nodrain() are durable
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int drain() {
+        if (!is_persistent()) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        if (mIsPmem) {
+            pmem_drain();
+            mSyncs++;
+            return 0;
+        }
+        std::vector<nv_range> ranges;
+        {
+            std::lock_guard<std::mutex> lk(mPendLock);
+            ranges.swap(mPending);
+        }
+        return ranges.empty() ? 0 : persistv(ranges);
+    }
+
+    virtual bool is_pmem(bool retest = false) {
+        return retest ? pmem_is_pmem(mVA, mSize) : mIsPmem;
+    }
+
+    /**
+     * @brief alignment that chunk offsets on this device must respect
+     */
+    virtual size_t align() const { return 1; }
+
+    /**
+     * @brief whether the device is backed by persistent storage,
+     *        memory based devices aren't
+     */
+    virtual bool is_persistent() const { return true; }
+
+    /**
+     * @brief copy into the mapping and persist the copy
+     *        NVM devices: streaming stores for large copies, cached 
+     *        stores and cache line flushes for small ones, and one fence
+     *        regular file based devices: streaming copy and one msync
+     *        memory based devices: plain copy
+     * 
+     * @param dst  destination within the mapping
+     * @param src  source, may overlap dst
+     * @param len  number of bytes
+     * @return int 0 if succ, else -1 with errno set
+     *             EROFS if the device isn't open read-write
+     */
+    int write(void* dst, const void* src, size_t len) {
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        bool overlap = (const char*)src < (char*)dst + len && 
+                       (char*)dst < (const char*)src + len;
+        if (mIsPmem) {
+            overlap ? pmem_memmove_persist(dst, src, len) :
+                      pmem_memcpy_persist(dst, src, len);
+            mSyncs++;
+            return 0;
+        }
+        if (overlap) {
+            ::memmove(dst, src, len);
+        }
+        else {
+            /* large copies use streaming stores, without NODRAIN they are fenced */
+            ::pmem_memcpy(dst, src, len, PMEM_F_MEM_NOFLUSH);
+        }
+        return is_persistent() ? persist(dst, len) : 0;
+    }
+
+    int zero() {
+        pinned pin(this);
+        return pin.va() ? zero(pin.va(), mSize) : -1;
+    }
+
+    /**
+     * @brief tell the kernel how a range will be accessed, the range is 
+     *        widened to whole pages
+     *        the pattern is remembered and reapplied whenever the range
+     *        is mapped again, a pattern for the whole device also covers
+     *        what grow() adds
+     * 
+     * @param addr start of the range, nullptr for the whole device
+     * @param size size of the range, 0 for the whole device
+     * @param how  the access pattern
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int advise(void* addr, size_t size, nv_advice how) {
+        nv_hint h = { 0, 0, how };
+        pinned  pin(this);
+        char*   base = (char*)pin.va();
+        if (!base) {
+            return -1;
+        }
+        if (addr && size) {
+            if ((char*)addr < base || (char*)addr + size > base + mSize) {
+                errno = EINVAL;
+                return -1;
+            }
+            h.off = (char*)addr - base;
+            h.len = size;
+        }
+        if (how < NV_ADVISE_NORMAL || how > NV_ADVISE_RANDOM) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> lk(mHintLock);
+        if (madvise_range(h.off, h.len ? h.len : mSize, how) != 0) {
+            return -1;
+        }
+        /* drop the patterns the new one overrides */
+        mHints.erase(std::remove_if(mHints.begin(), mHints.end(), [&h](const nv_hint & o) {
+            return !h.len || (o.len && h.off <= o.off && o.off + o.len <= h.off + h.len);
+        }), mHints.end());
+        mHints.push_back(h);
+        return 0;
+    }
+
+    /**
+     * @brief read ranges of the device ahead in the background
+     *        file based devices readahead() the file into the page cache,
+     *        other devices madvise(MADV_WILLNEED)
+     *        the device is pinned only while the warm-up is set up, the
+     *        reader of a lazy (file based) device works on file offsets
+     * 
+     * @param ranges ranges of the mapping, the whole device if empty
+     * @return std::shared_ptr<nv_warmup> the warm-up, to report progress,
+     *         cancel or wait for it, dropping it leaves the warm-up
+     *         running, nullptr with errno set if failed
+     */
+    std::shared_ptr<nv_warmup> warmup(std::vector<nv_range> ranges = std::vector<nv_range>()) {
+        pinned pin(this);
+        char*  base = (char*)pin.va();
+        if (!base) {
+            return nullptr;
+        }
+        if (ranges.empty()) {
+            ranges.push_back({ base, mSize });
+        }
+        for (auto & r : ranges) {
+            if ((char*)r.addr < base || (char*)r.addr + r.size > base + mSize) {
+                errno = EINVAL;
+                return nullptr;
+            }
+        }
+        nv_warmup::reader rd = warm_reader();
+        if (!rd) {
+            return nullptr;
+        }
+        try {
+            return std::make_shared<nv_warmup>(rd, ranges);
+        }
+        catch (std::system_error & e) {
+            errno = e.code().value();
+            return nullptr;
+        }
+    }
+
+    /**
+     * @brief tell the device a range is no longer needed, its blocks and
+     *        page cache, or its memory, are released and it reads as zeros
+     *        file based devices punch a hole, memory based devices drop 
+     *        the pages, whole pages in the range are released and the 
+     *        partial pages at its edges are zeroed
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int discard(void* addr, size_t size) {
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        pinned pin(this);
+        char*  base = (char*)pin.va();
+        if (!base) {
+            return -1;
+        }
+        if ((char*)addr < base || (char*)addr + size > base + mSize) {
+            errno = EINVAL;
+            return -1;
+        }
+        uintptr_t pg = mPageSize;
+        char*     b  = (char*)(((uintptr_t)addr + pg - 1) & ~(pg - 1));
+        char*     e  = (char*)(((uintptr_t)addr + size) & ~(pg - 1));
+        if (b >= e) {
+            return zero(addr, size, NV_ZERO_MEMSET);
+        }
+        if (discard_pages(b, e - b) != 0) {
+            return -1;
+        }
+        if ((b > (char*)addr && zero(addr, b - (char*)addr, NV_ZERO_MEMSET) != 0) ||
+            ((char*)addr + size > e && zero(e, (char*)addr + size - e, NV_ZERO_MEMSET) != 0)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief zero a range and persist it once at the end
+     *        large ranges are split among nthreads threads that write
+     *        with non-temporal stores, so the caches are not polluted
+     * 
+     * @param addr     start of the range
+     * @param size     size of the range
+     * @param how      how to clear the range, see nv_zero
+     * @param nthreads number of threads, 0 for all cpus
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int zero(void* addr, size_t size, nv_zero how = NV_ZERO_AUTO, 
+                     unsigned nthreads = 0) {
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        if (how == NV_ZERO_FALLOCATE) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if (how == NV_ZERO_AUTO) {
+            how = size >= NV_ZERO_SLICE ? NV_ZERO_NT : NV_ZERO_MEMSET;
+        }
+
+        /* caches are flushed by persist() below if not pmem */
+        unsigned flags = PMEM_F_MEM_NODRAIN | (mIsPmem ? 0 : PMEM_F_MEM_NOFLUSH);
+        if (how == NV_ZERO_NT) {
+            flags |= PMEM_F_MEM_NONTEMPORAL;
+            if (!nthreads) {
+                nthreads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            size_t nslices = std::max((size_t)1, std::min((size_t)nthreads, size / NV_ZERO_SLICE));
+            size_t slice   = (size / nslices) & ~(size_t)(NV_CACHELINE - 1);
+            nv_parallel_for(nslices, nslices, [&](size_t b, size_t e) {
+                char*  p   = (char*)addr + b * slice;
+                size_t len = e == nslices ? size - b * slice : (e - b) * slice;
+                ::pmem_memset(p, 0, len, flags);
+                /* each thread, the caller too, fences its streaming stores */
+                pmem_drain();
+            });
+        }
+        else {
+            ::pmem_memset(addr, 0, size, flags);
+            pmem_drain();
+        }
+
+        if (!is_persistent()) {
+            return 0;
+        }
+        if (mIsPmem) {
+            mSyncs++;
+            return 0;
+        }
+        return persist(addr, size);
+    }
+
+};
+
+/**
+ * @brief the lazy map keeps track of the mapped lazy devices and unmaps
+ *        idle ones once more than a budget of them are mapped
+ *        idle devices are found with the clock algorithm, an 
+ *        approximation of LRU: va() marks a device referenced, the scan
+ *        gives referenced devices a second chance, pinned devices are
+ *        never unmapped
+ * 
+ */
+class nv_lazymap : public Singleton<nv_lazymap>
+{
+private:
+GTEST_ONLY(public:)
+    std::mutex          mLock;
+    std::set<nv_dev*>   mMapped;        // mapped lazy devices
+    nv_dev*             mHand;          // where the clock scan resumes
+    size_t              mBudget;        // most mapped lazy devices, 0 for no limit
+    uint64_t            mEvictions;     // devices unmapped by the scan
+
+    /**
+     * @brief unmap idle devices, except keep, until the budget is met
+     *        at most two rounds of the clock are scanned, more devices 
+     *        than the budget stay mapped if the others are pinned or busy
+     */
+    void evict(nv_dev* keep) {
+        size_t scanned = 0, limit = 2 * mMapped.size();
+        while (mBudget && mMapped.size() > mBudget && scanned++ < limit) {
+            auto it = mMapped.upper_bound(mHand);
+            if (it == mMapped.end()) {
+                it = mMapped.begin();
+            }
+            nv_dev* d = mHand = *it;
+            if (d == keep || d->mRef.exchange(false)) {
+                continue;
+            }
+            /* never wait for a device that is mapping, pinning or closing */
+            if (!d->mMapLock.try_lock()) {
+                continue;
+            }
+            if (!d->mPins && d->unmap_lazy()) {
+                d->mMapped.store(false);
+                d->remapped();
+                mMapped.erase(it);
+                mEvictions++;
+            }
+            d->mMapLock.unlock();
+        }
+    }
+
+public:
+    nv_lazymap() : mHand(nullptr), mBudget(0), mEvictions(0) {}
+
+    /**
+     * @brief set the most lazy devices that stay mapped, 0 for no limit
+     */
+    void set_budget(size_t maxmaps) {
+        std::lock_guard<std::mutex> lk(mLock);
+        mBudget = maxmaps;
+        evict(nullptr);
+    }
+
+    size_t budget() {
+        std::lock_guard<std::mutex> lk(mLock);
+        return mBudget;
+    }
+
+    size_t nmapped() {
+        std::lock_guard<std::mutex> lk(mLock);
+        return mMapped.size();
+    }
+
+    uint64_t nevictions() {
+        std::lock_guard<std::mutex> lk(mLock);
+        return mEvictions;
+    }
+
+    /**
+     * @brief a lazy device was mapped
+     */
+    void mapped(nv_dev* d) {
+        std::lock_guard<std::mutex> lk(mLock);
+        mMapped.insert(d);
+        evict(d);
+    }
+
+    /**
+     * @brief a lazy device is closing, it's never unmapped by the scan
+     *        once this returns
+     */
+    void forget(nv_dev* d) {
+        std::lock_guard<std::mutex> lk(mLock);
+        mMapped.erase(d);
+    }
+};
+
+inline void* nv_dev::map_va() {
+    if (!mMapped.load(std::memory_order_acquire)) {
+        bool mapped = false;
+        {
+            std::lock_guard<std::mutex> lk(mMapLock);
+            if (!mMapped.load(std::memory_order_relaxed)) {
+                if (!map_lazy()) {
+                    return nullptr;
+                }
+                apply_hints(0, mSize);
+                mMapped.store(true, std::memory_order_release);
+                remapped();
+                mapped = true;
+            }
+        }
+        if (mapped) {
+            nv_lazymap::instance().mapped(this);
+        }
+    }
+    if (!mRef.load(std::memory_order_relaxed)) {
+        mRef.store(true, std::memory_order_relaxed);
+    }
+    return mVA;
+}
+
+inline void nv_addrindex::add(nvchunk* chunk, const nv_dev* dev, size_t off, size_t len) {
+    pthread_rwlock_wrlock(&mLock);
+    auto r = mDevs.insert({ dev, devent() });
+    devent & de = r.first->second;
+    if (r.second) {
+        de.va = de.size = de.nlive = 0;
+        /* with the lock held, a device mapped or unmapped meanwhile 
+           reports its new mapping after this */
+        if (dev->is_mapped() && dev->mVA) {
+            de.va   = (uintptr_t)dev->mVA;
+            de.size = dev->mSize;
+            mRanges[de.va] = &de;
+        }
+    }
+    size_t end = off + len;
+    size_t k, pos = 0;
+    for (k = 0; k < de.layers.size(); k++) {
+        layer & l = de.layers[k];
+        pos = std::lower_bound(l.offs.begin(), l.offs.end(), off) - l.offs.begin();
+        if (fits(l, pos, off, end)) {
+            break;
+        }
+    }
+    if (k == de.layers.size()) {
+        de.layers.push_back(layer());
+        pos = 0;
+    }
+    layer & l = de.layers[k];
+    l.offs.insert(l.offs.begin() + pos, off);
+    l.ents.insert(l.ents.begin() + pos, chunkent{ end, chunk });
+    de.nlive++;
+    pthread_rwlock_unlock(&mLock);
+}
+
+/**
+ * @brief an nv_filedev is an nv_dev backed by a file
+ *        the backing file can be a file on dax file system
+ *        or a DAX raw device or a file on a regular file system
+ * 
+ */
+class nv_filedev : public nv_dev {
+protected:
+    dev_t     mFileDev;          // identity of the mapped file, the device
+    ino_t     mFileIno;          // holds no fd on it, see open_fd()
+    size_t    mReserve;          // reserved address space, 0 if not growable
+    size_t    mMapLen;           // length of the file mapping in mReserve
+    nv_alloc  mAlloc;            // block allocation policy
+    nv_devopts mOpts;            // options to map the file with
+
+    /**
+     * @brief allocate the blocks of [off, off+len) of the backing file
+     *        according to the allocation policy
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int allocate(int fd, size_t off, size_t len) {
+        if( mAlloc == NV_ALLOC_SPARSE || !len ) {
+            return 0;
+        }
+        int err = ::posix_fallocate(fd, off, len);
+        if( err ) {
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief an fd of the backing file, closed at the end of the scope
+     */
+    struct file {
+        int fd;
+        explicit file(int f) : fd(f) {}
+        ~file() {
+            if( fd != -1 ) {
+                int err = errno;
+                ::close(fd);
+                errno = err;
+            }
+        }
+        file(const file &) = delete;
+        file & operator=(const file &) = delete;
+    };
+
+    /**
+     * @brief remember which file is mapped
+     */
+    void identify(const struct stat & st) {
+        mFileDev = st.st_dev;
+        mFileIno = st.st_ino;
+    }
+
+    /**
+     * @brief open the backing file for a call that needs an fd
+     *        a mapped device keeps no fd open, so that the number of
+     *        devices isn't limited by RLIMIT_NOFILE
+     *
+     * @return int the fd, -1 with errno set, ESTALE if the path no
+     *         longer names the mapped file
+     */
+    int open_fd() const {
+        struct stat st;
+        file f(::open(mName.c_str(), (mMode == NV_OPEN_RDWR ? O_RDWR : O_RDONLY) | O_CLOEXEC));
+        if( f.fd == -1 || ::fstat(f.fd, &st) != 0 ) {
+            return -1;
+        }
+        if( st.st_dev != mFileDev || st.st_ino != mFileIno ) {
+            errno = ESTALE;
+            return -1;
+        }
+        int fd = f.fd;
+        f.fd = -1;
+        return fd;
+    }
+
+    /**
+     * @brief the page cache of the file is allocated by the policy of
+     *        the faulting thread, not the one of the mapping
+     */
+    virtual bool numa_mbind() const override { return false; }
+
+    /**
+     * @brief readahead() an fd of its own, so that the warm-up 
+     *        doesn't depend on the device staying open
+     */
+    virtual nv_warmup::reader warm_reader() override {
+        int fd = open_fd();
+        if( fd == -1 ) {
+            return nullptr;
+        }
+        std::shared_ptr<int> dup(new int(fd), [](int* p) { ::close(*p); delete p; });
+        char* base = (char*)mVA;
+        return [dup, base](void* addr, size_t len) {
+            off_t off = (char*)addr - base;
+            if( ::readahead(*dup, off, len) == 0 ) {
+                return 0;
+            }
+            int err = ::posix_fadvise(*dup, off, len, POSIX_FADV_WILLNEED);
+            errno = err;
+            return err ? -1 : 0;
+        };
+    }
+
+    /**
+     * @brief punch a hole, the file system frees the blocks and drops 
+     *        the pages from the page cache
+     */
+    virtual int discard_pages(void* addr, size_t len) override {
+        file f(open_fd());
+        if( f.fd == -1 ) {
+            return -1;
+        }
+        return ::fallocate(f.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                           (char*)addr - (char*)mVA, len);
+    }
+
+    /**
+     * @brief ask the file system to allocate a file in extents of extsize
+     *        bytes, so that its dax mapping can be served by PMD faults
+     *        only XFS takes the hint, and only on an empty file
+     */
+    static void set_extsize(int fd, size_t extsize) {
+        struct fsxattr fa;
+        if( ::ioctl(fd, FS_IOC_FSGETXATTR, &fa) == 0 ) {
+            fa.fsx_xflags |= FS_XFLAG_EXTSIZE;
+            fa.fsx_extsize = extsize;
+            ::ioctl(fd, FS_IOC_FSSETXATTR, &fa);
+        }
+    }
+
+    /**
+     * @brief whether cache flushes can persist a MAP_SYNC mapping, the
+     *        same check pmem_map_file() makes before asking for one
+     */
+    static bool sync_flushable() {
+#ifdef HAVE_LIBPMEM_H
+        return true;
+#else
+        return cpmem_flush_type() != CPMEM_FLUSH_NONE;
+#endif
+    }
+
+    /**
+     * @brief map [off, off+len) of fd at va()+off
+     *        MAP_SYNC is tried first so that a dax file system can be
+     *        persisted with cache flushes, and the mapping is registered
+     *        the way pmem_map_file() registers its own
+     */
+    bool map_fixed(int fd, size_t off, size_t len) {
+        char* a = (char*)mVA + off;
+        void* p = MAP_FAILED;
+        if (sync_flushable() && (!off || mIsPmem)) {
+            p = ::mmap(a, len, PROT_READ|PROT_WRITE, 
+                       MAP_SHARED_VALIDATE|MAP_SYNC|MAP_FIXED, fd, off);
+        }
+        if (p == MAP_FAILED) {
+            /* the whole mapping has to be persisted the same way */
+            if (off && mIsPmem) {
+                return false;
+            }
+            p = ::mmap(a, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, off);
+            if (p == MAP_FAILED) {
+                return false;
+            }
+            mIsPmem = 0;
+            return true;
+        }
+        mIsPmem = 1;
+#ifndef HAVE_LIBPMEM_H
+        cpmem_sync_ranges::instance().add(mVA, off + len);
+#endif
+        return true;
+    }
+
+    /**
+     * @brief check that an existing file can be opened read-only and
+     *        take size bytes of it as the device, the whole file if 0
+     */
+    void size_rdonly(size_t size, bool create) {
+        struct stat st;
+
+        if( create ) {
+            errno = EROFS;
+            throw nv_exception("can't create a read-only device.");
+        }
+        if( ::stat(mName.c_str(), &st) != 0 ) {
+            throw nv_exception("failed to stat read-only device.");
+        }
+        if( !st.st_size || size > (size_t)st.st_size ) {
+            errno = EINVAL;
+            throw nv_exception("invalid size of read-only device.");
+        }
+        mSize = size ? size : st.st_size;
+    }
+
+    /**
+     * @brief open and map the backing file of mSize bytes
+     *        NV_OPEN_RDONLY maps it shared read-only, NV_OPEN_COW private
+     *        a growable device maps it into reserved address space
+     *        otherwise pmem_map_file maps it, and creates it with flags
+     *        and size if asked to
+     */
+    void map_file(int flags = 0, size_t size = 0) {
+        size_t mapped_len   = 0;
+        int    is_pmem      = 0;
+        struct stat st;
+
+        if( mMode != NV_OPEN_RDWR ) {
+            file f(::open(mName.c_str(), O_RDONLY | O_CLOEXEC));
+            if( f.fd == -1 || ::fstat(f.fd, &st) != 0 ) {
+                throw nv_exception("failed to open device.");
+            }
+            identify(st);
+            bool cow = mMode == NV_OPEN_COW;
+            mVA = ::mmap(NULL, mSize, cow ? PROT_READ|PROT_WRITE : PROT_READ, 
+                         cow ? MAP_PRIVATE : MAP_SHARED, f.fd, 0);
+            if( mVA == MAP_FAILED ) {
+                mVA = nullptr;
+                throw nv_exception("failed to map device.");
+            }
+            mMapLen = mSize;
+        }
+        else if( mOpts.reserve > mSize ) {
+            /* growable: reserve the address space, then map the file into it */
+            file f(::open(mName.c_str(), O_RDWR | O_CLOEXEC));
+            if( f.fd == -1 || ::fstat(f.fd, &st) != 0 ) {
+                throw nv_exception("failed to open device.");
+            }
+            identify(st);
+            mReserve = (mOpts.reserve + nv_pagesize() - 1) & ~(nv_pagesize() - 1);
+            mVA = ::mmap(NULL, mReserve, PROT_NONE, 
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+            if( mVA == MAP_FAILED ) {
+                mVA = nullptr;
+                mReserve = 0;
+                throw nv_exception("failed to reserve address space.");
+            }
+            mMapLen = (mSize + nv_pagesize() - 1) & ~(nv_pagesize() - 1);
+            if( !map_fixed(f.fd, 0, mMapLen) ) {
+                unmap_file();
+                throw nv_exception("failed to map device.");
+            }
+        }
+        else {
+            if((mVA = (void*)pmem_map_file(mName.c_str(), size, flags, 0666, &mapped_len, &is_pmem)) == nullptr) {
+                throw nv_exception("failed to map device.");
+            }
+            mMapLen = mapped_len;
+            if(mapped_len != mSize) {
+                unmap_file();
+                throw nv_exception("partial mapped device.");
+            }
+            mIsPmem = pmem_is_pmem(mVA, mSize);
+            if( ::stat(mName.c_str(), &st) != 0 ) {
+                unmap_file();
+                throw nv_exception("failed to open device.");
+            }
+            identify(st);
+        }
+        numa_bind(mVA, mMapLen, mOpts);
+    }
+
+    /**
+     * @brief unmap the backing file, the size is kept
+     */
+    bool unmap_file() {
+        if( mReserve ) {
+            if(mVA && ::munmap(mVA, mReserve)) {
+                return false;
+            }
+#ifndef HAVE_LIBPMEM_H
+            cpmem_sync_ranges::instance().remove(mVA);
+#endif
+        }
+        else if(mVA && mMapLen && pmem_unmap(mVA, mMapLen)) {
+            return false;
+        }
+        mVA      = nullptr;
+        mMapLen  = mReserve = 0;
+        return true;
+    }
+
+    /**
+     * @brief a lazy device holds neither a mapping nor an fd while unmapped
+     */
+    virtual bool map_lazy() override {
+        try {
+            map_file();
+        }
+        catch (nv_exception & e) {
+            return false;
+        }
+        if (prefault((char*)mVA, mOpts.prefault, mOpts.prefault_threads) != 0) {
+            int err = errno;
+            unmap_file();
+            errno = err;
+            return false;
+        }
+        return true;
+    }
+    virtual bool unmap_lazy() override { return unmap_file(); }
+
+public:
+    /**
+     * @brief Construct a new nvm device object with file type backing device
+     *        - Open if backing device file already exists
+     *        - Create if backing device file does not exist
+     * 
+     * @param name the path to nvm device file
+     * @param size size of the backing file for creation
+     * @param opts opts.numa_node/opts.numa_interleave bind the mapping,
+     *             only pages not yet shared with others can be migrated
+     *             opts.prefault faults in the whole mapping before return
+     *             opts.reserve reserves address space so that the device
+     *             can grow in place up to opts.reserve bytes
+     *             opts.mode NV_OPEN_RDONLY/NV_OPEN_COW open an existing
+     *             file read-only and map it shared read-only or private
+     *             copy-on-write, such devices can't be flushed or grown
+     *             opts.alloc allocates the blocks of a created or resized
+     *             file, and of the tail added by grow(), up front, so that
+     *             page faults don't allocate blocks
+     *             opts.alloc_align sets an extent size hint on a new file
+     *             opts.lazy creates and sizes the file but maps it on the
+     *             first call of va(), the other options apply then
+     */
+    nv_filedev(string path, size_t size=0, bool create=false,
+               const nv_devopts & opts = nv_devopts()) 
+        : nv_dev(path, size), mFileDev(0), mFileIno(0), mReserve(0), mMapLen(0), mAlloc(opts.alloc),
+          mOpts(opts)
+    {
+        struct stat st;
+        int    flags        = 0;
+        bool   fresh        = false;    // the file is new
+        bool   sized        = false;    // the file is new or resized
+
+        if (create && size <= 0) {
+            throw nv_exception("creating file with zero size.");
+        }
+
+        mMode = opts.mode;
+        mLazy = opts.lazy;
+        if( mMode != NV_OPEN_RDWR ) {
+            size_rdonly(size, create);
+        }
+        else if( stat(mName.c_str(), &st) != 0 ) {
+            /* backing file doesn't not exist, create and map with given size */
+            if(!size) {
+                throw nv_exception("new file with zero size.");
+            }
+            fresh = sized = true;
+            mSize = size;
+        }
+        else {
+            if (create) {
+                /* backing file exists, apply new size if create */
+                if ( ::truncate (mName.c_str(), size) != 0 ) {
+                    throw nv_exception( std::string("failed to apply new size to file .") + mName );
+                }
+                sized = true;
+                mSize = size;
+            }
+            else {
+                /* backing file exists, just map the whole file if no create */
+                mSize = st.st_size;
+            }
+        }
+
+        if( fresh && (opts.reserve > mSize || opts.alloc_align || mLazy) ) {
+            /* create the file before mapping it, an extent size hint 
+               only applies to an empty file */
+            int fd = ::open(mName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            if( fd == -1 ) {
+                throw nv_exception("failed to create device.");
+            }
+            if( opts.alloc_align ) {
+                set_extsize(fd, opts.alloc_align);
+            }
+            int rt = ::ftruncate(fd, mSize);
+            ::close(fd);
+            if( rt != 0 ) {
+                ::unlink(mName.c_str());
+                throw nv_exception("failed to size device.");
+            }
+        }
+        else if( fresh ) {
+            flags |= PMEM_FILE_CREATE;
+        }
+
+        if( mLazy ) {
+            if( sized && mAlloc != NV_ALLOC_SPARSE ) {
+                file f(::open(mName.c_str(), O_RDWR | O_CLOEXEC));
+                if( f.fd == -1 || allocate(f.fd, 0, mSize) != 0 ) {
+                    throw nv_exception("failed to allocate device.");
+                }
+            }
+            return;
+        }
+
+        /* pmem_map_file takes a size only to create a file */
+        map_file(flags, flags ? size : 0);
+        if( sized && mAlloc != NV_ALLOC_SPARSE ) {
+            file f(open_fd());
+            if( f.fd == -1 || allocate(f.fd, 0, mSize) != 0 ) {
+                close();
+                throw nv_exception("failed to allocate device.");
+            }
+        }
+        if (prefault(opts.prefault, opts.prefault_threads) != 0) {
+            close();
+            throw nv_exception("failed to prefault device.");
+        }
+    }
+
+    virtual bool close() override {
+        if( mLazy ) {
+            nv_lazymap::instance().forget(this);
+            std::lock_guard<std::mutex> lk(mMapLock);
+            mMapped.store(false);
+            if( !unmap_file() ) {
+                return false;
+            }
+        }
+        else if( !unmap_file() ) {
+            return false;
+        }
+        mSize = 0;
+        remapped();
+        return true;
+    }
+
+    /**
+     * @brief zero a range of the device
+     *        NV_ZERO_FALLOCATE (and NV_ZERO_AUTO on large ranges of a 
+     *        regular file system) let the file system zero the pages
+     *        with FALLOC_FL_ZERO_RANGE, or punch a hole if that is not 
+     *        supported, instead of writing them
+     *
+     * @return int 0 if succ, else -1 with errno set
+     */
+    using nv_dev::zero;
+    virtual int zero(void* addr, size_t size, nv_zero how = NV_ZERO_AUTO, 
+                     unsigned nthreads = 0) override {
+        if (!writable()) {
+            errno = EROFS;
+            return -1;
+        }
+        if (how == NV_ZERO_AUTO && !mIsPmem && size >= NV_ZERO_SLICE) {
+            how = NV_ZERO_FALLOCATE;
+        }
+        if (how != NV_ZERO_FALLOCATE) {
+            return nv_dev::zero(addr, size, how, nthreads);
+        }
+
+        /* the file system zeroes whole pages, the edges are memset */
+        uintptr_t pg = nv_pagesize();
+        char*     b  = (char*)(((uintptr_t)addr + pg - 1) & ~(pg - 1));
+        char*     e  = (char*)(((uintptr_t)addr + size) & ~(pg - 1));
+        if (b >= e) {
+            return nv_dev::zero(addr, size, NV_ZERO_MEMSET);
+        }
+        off_t off = b - (char*)mVA;
+        file  f(open_fd());
+        if (f.fd == -1 ||
+            (::fallocate(f.fd, FALLOC_FL_ZERO_RANGE, off, e - b) != 0 &&
+             ::fallocate(f.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, e - b) != 0)) {
+            return -1;
+        }
+        ::pmem_memset(addr, 0, b - (char*)addr, PMEM_F_MEM_NODRAIN);
+        ::pmem_memset(e, 0, (char*)addr + size - e, PMEM_F_MEM_NODRAIN);
+        pmem_drain();
+        return persist(addr, size);
+    }
+
+    /**
+     * @brief grow the backing file and map the new tail in place
+     *        only devices opened with nv_devopts::reserve can grow
+     * 
+     * @param new_size new size of the device, up to the reserved size
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int grow(size_t new_size) override {
+        if( !writable() ) {
+            errno = EROFS;
+            return -1;
+        }
+        pinned pin(this);
+        if( !pin.va() ) {
+            return -1;
+        }
+        if( !mReserve ) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if( new_size < mSize ) {
+            errno = EINVAL;
+            return -1;
+        }
+        if( new_size > mReserve ) {
+            errno = ENOMEM;
+            return -1;
+        }
+        file f(open_fd());
+        if( f.fd == -1 || ftruncate(f.fd, new_size) != 0 ) {
+            return -1;
+        }
+        if( allocate(f.fd, mSize, new_size - mSize) != 0 ) {
+            int err = errno;
+            if( ftruncate(f.fd, mSize) != 0 ) {
+                err = errno;
+            }
+            errno = err;
+            return -1;
+        }
+
+        size_t maplen = (new_size + nv_pagesize() - 1) & ~(nv_pagesize() - 1);
+        if( maplen > mMapLen ) {
+            if( !map_fixed(f.fd, mMapLen, maplen - mMapLen) ) {
+                return -1;
+            }
+            size_t old = mMapLen;
+            mMapLen = maplen;
+            mSize   = new_size;
+            apply_hints(old, maplen - old);
+        }
+        mSize = new_size;
+        remapped();
+        return 0;
+    }
+
+    /**
+     * @brief copy a range of the device into a new file at a point in time
+     *        the range is cloned in milliseconds on file systems that
+     *        share extents (XFS, btrfs), and copied in parallel otherwise,
+     *        see nv_clone_range()
+     *        all stores made to the mapping before the call are in the
+     *        copy, writers must be paused for the copy to be consistent
+     *        private pages of an NV_OPEN_COW device aren't copied
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    virtual int snapshot(const string & dest, size_t off = 0, size_t len = 0,
+                         unsigned nthreads = 0) override {
+        struct stat ds;
+        pinned pin(this);
+        if( !pin.va() ) {
+            return -1;
+        }
+        if( !len ) {
+            len = off < mSize ? mSize - off : 0;
+        }
+        if( !len || off + len > mSize ) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* never truncate the device itself */
+        if( ::stat(dest.c_str(), &ds) == 0 && ds.st_dev == mFileDev && ds.st_ino == mFileIno ) {
+            errno = EINVAL;
+            return -1;
+        }
+        file src(open_fd());
+        if( src.fd == -1 ) {
+            return -1;
+        }
+
+        int fd = ::open(dest.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if( fd == -1 ) {
+            return -1;
+        }
+        int rt = nv_clone_range(src.fd, off, fd, len, nthreads);
+        int err = errno;
+        ::close(fd);
+        if( rt != 0 ) {
+            ::unlink(dest.c_str());
+            errno = err;
+        }
+        return rt;
+    }
+
+    /**
+     * @brief flush data onto persistent memory
+     *        calling pmem_persist for NVM devices (NVDIMM, Optane)
+     *        calling pmem_msync for regular file based devices
+     *
+     * @param addr the starting address to flush
+     * @param size size of data to flush
+     * @return int 0 if succ, else -1 and errno tells why
+     */
+    virtual int flush(void* addr = 0, size_t size = 0) override { 
+        return persist(addr, size);
+    }
+    
+    const string & path() {
+        return mName;
+    }
+
+    virtual ~nv_filedev() { close(); }
+
+};
+
+/**
+ * @brief an nv_devdaxdev is an nv_dev backed by a devdax character device
+ *        (e.g. /dev/dax0.0). the size and alignment of the device come 
+ *        from sysfs, the mapping is placed at the device alignment so that
+ *        the kernel can serve PMD/PUD faults
+ * 
+ */
+class nv_devdaxdev : public nv_dev {
+protected:
+    size_t    mAlign;            // alignment of the device
+    size_t    mMapLen;           // length of the mapping
+
+    /**
+     * @brief read a number from a sysfs attribute
+     * 
+     * @return true if the attribute exists and holds a number
+     */
+    static bool sysfs_read(const string & path, size_t & val) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            return false;
+        }
+        bool ok = fscanf(f, "%zu", &val) == 1;
+        fclose(f);
+        return ok;
+    }
+
+public:
+    /**
+     * @brief Construct a new devdax device object
+     * 
+     * @param path  the path to the devdax device
+     * @param size  size to map, 0 for the whole device
+     *              the device can't be resized, size must not exceed it
+     * @param opts  opts.numa_node/opts.numa_interleave/opts.prefault 
+     *              are applied as for nv_filedev
+     * @param sysfs root of sysfs, where the device attributes are found at
+     *              <sysfs>/dev/char/<major>:<minor>/size and 
+     *              <sysfs>/dev/char/<major>:<minor>/device/align
+     */
+    nv_devdaxdev(string path, size_t size = 0, const nv_devopts & opts = nv_devopts(),
+                 const string & sysfs = "/sys") 
+        : nv_dev(path, size), mAlign(mPageSize), mMapLen(0)
+    {
+        struct stat st;
+        size_t devsize = 0;
+
+        if( stat(mName.c_str(), &st) != 0 ) {
+            throw nv_exception("devdax device doesn't exist.");
+        }
+
+        string attr = sysfs + "/dev/char/" + std::to_string(major(st.st_rdev)) 
+                            + ":" + std::to_string(minor(st.st_rdev));
+        if( !sysfs_read(attr + "/size", devsize) ) {
+            throw nv_exception("failed to read devdax size from " + attr);
+        }
+        /* kernels without the align attribute map at page alignment */
+        sysfs_read(attr + "/device/align", mAlign);
+        if( !mAlign || (mAlign & (mAlign - 1)) ) {
+            errno = EINVAL;
+            throw nv_exception("invalid devdax alignment.");
+        }
+
+        if( size > devsize ) {
+            errno = EINVAL;
+            throw nv_exception("size exceeds the devdax device.");
+        }
+        mSize   = size ? size : devsize;
+        mMapLen = std::min((mSize + mAlign - 1) & ~(mAlign - 1), devsize);
+
+        /* devdax can't be mapped private */
+        mMode = opts.mode;
+        if( mMode == NV_OPEN_COW ) {
+            errno = EINVAL;
+            throw nv_exception("devdax devices can't be copy-on-write.");
+        }
+        int fd = ::open(mName.c_str(), writable() ? O_RDWR : O_RDONLY);
+        if( fd == -1 ) {
+            throw nv_exception("failed to open devdax device.");
+        }
+
+        /* reserve enough address space to place the mapping at mAlign */
+        char* r = (char*) ::mmap(NULL, mMapLen + mAlign, PROT_NONE, 
+                                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if( r == MAP_FAILED ) {
+            ::close(fd);
+            throw nv_exception("failed to reserve address space for devdax.");
+        }
+        char* a = (char*)(((uintptr_t)r + mAlign - 1) & ~(mAlign - 1));
+        void* p = ::mmap(a, mMapLen, writable() ? PROT_READ|PROT_WRITE : PROT_READ, 
+                         MAP_SHARED|MAP_FIXED, fd, 0);
+        ::close(fd);
+        if( p == MAP_FAILED ) {
+            ::munmap(r, mMapLen + mAlign);
+            throw nv_exception("failed to map devdax device.");
+        }
+        if( a > r ) {
+            ::munmap(r, a - r);
+        }
+        if( r + mAlign > a ) {
+            ::munmap(a + mMapLen, r + mAlign - a);
+        }
+        mVA = p;
+
+        if( S_ISCHR(st.st_mode) ) {
+            /* a devdax device is always persistent memory */
+            mIsPmem   = 1;
+            mPageSize = mAlign;
+            mHugePage = mAlign >= GB ? NV_HUGEPAGE_1G : 
+                        mAlign >= 2 * MB ? NV_HUGEPAGE_2M : NV_HUGEPAGE_NONE;
+        }
+        else {
+            /* a regular file standing in for a devdax device */
+            mIsPmem = pmem_is_pmem(mVA, mSize);
+        }
+
+        numa_bind(mVA, mMapLen, opts);
+        if (prefault(opts.prefault, opts.prefault_threads) != 0) {
+            close();
+            throw nv_exception("failed to prefault device.");
+        }
+    }
+
+    /**
+     * @brief the memory of a devdax device lives on its own node,
+     *        a file standing in for one is in the page cache
+     */
+    virtual bool numa_mbind() const override { return false; }
+
+    virtual size_t align() const override { return mAlign; }
+
+    virtual bool close() override {
+        if(mVA && mMapLen && ::munmap(mVA, mMapLen)) {
+            return false;
+        }
+        mVA     = nullptr;
+        mSize   = mMapLen = 0;
+        remapped();
+        return true;
+    }
+
+    virtual int flush(void* addr = 0, size_t size = 0) override { 
+        return persist(addr, size);
+    }
+
+    virtual ~nv_devdaxdev() { close(); }
+};
+
+/**
+ * @brief an nv_memdev is an nv_dev backed by memory
+ * 
+ */
+class nv_memdev : public nv_dev {
+protected:
+    void*     mMapVA;            // start of the whole anonymous mapping
+    size_t    mMapLen;           // length of the whole anonymous mapping
+
+    virtual bool prefault_write() const override { return true; }
+
+    /**
+     * @brief map with explicit hugetlb pages of size pgsz
+     * 
+     * @return true if the hugetlb pages were reserved
+     */
+    bool map_hugetlb(size_t pgsz) {
+        size_t len = (mSize + pgsz - 1) & ~(pgsz - 1);
+        int    flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB |
+                       (__builtin_ctzl(pgsz) << MAP_HUGE_SHIFT);
+
+        void* p = ::mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        mVA       = mMapVA = p;
+        mMapLen   = len;
+        mPageSize = pgsz;
+        mHugePage = pgsz == GB ? NV_HUGEPAGE_1G : NV_HUGEPAGE_2M;
+        return true;
+    }
+
+    /**
+     * @brief map with base pages aligned to the PMD size
+     *        and ask for transparent hugepages, see confirm_thp()
+     * 
+     * @return true if mapped
+     */
+    bool map_thp() {
+        size_t pmd = thp_size();
+        if (!pmd || mSize < pmd) {
+            return false;
+        }
+
+        /* over map by one PMD so the range can be PMD aligned */
+        size_t len = mSize + pmd;
+        char*  p   = (char*) ::mmap(NULL, len, PROT_READ | PROT_WRITE, 
+                                    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        char*  a    = (char*)(((uintptr_t)p + pmd - 1) & ~(pmd - 1));
+        size_t head = a - p;
+        size_t tail = len - head - mSize;
+        if (head) ::munmap(p, head);
+        if (tail) ::munmap(a + mSize, tail);
+
+        mVA = mMapVA = a;
+        mMapLen = mSize;
+        if (::madvise(a, mSize, MADV_HUGEPAGE) == 0) {
+            mHugePage = NV_HUGEPAGE_THP;
+        }
+        return true;
+    }
+
+    /**
+     * @brief fault in the first PMD of a THP mapping and check it got a
+     *        hugepage, the kernel may still hand out base pages (defrag
+     *        off, fragmented memory, khugepaged only), pagesize() stays
+     *        the base page size then
+     *        called once the mapping is bound to its NUMA nodes
+     */
+    void confirm_thp() {
+        size_t pmd = thp_size();
+        if (mHugePage != NV_HUGEPAGE_THP || !pmd) {
+            return;
+        }
+        *(volatile char*)mVA = 0;
+        if (anon_huge_kb(mVA) * KB >= pmd) {
+            mPageSize = pmd;
+        }
+        else {
+            mHugePage = NV_HUGEPAGE_NONE;
+        }
+    }
+
+    /**
+     * @brief AnonHugePages of the mapping holding addr in 
+     *        /proc/self/smaps, in kB
+     */
+    static size_t anon_huge_kb(const void* addr) {
+        FILE* f = fopen("/proc/self/smaps", "r");
+        if (!f) {
+            return 0;
+        }
+        char   line[256];
+        bool   found = false;
+        size_t kb = 0;
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long b, e;
+            char* colon = strchr(line, ':');
+            char* space = strchr(line, ' ');
+            if (sscanf(line, "%lx-%lx ", &b, &e) == 2 && space && colon > space) {
+                found = b <= (uintptr_t)addr && (uintptr_t)addr < e;
+            }
+            else if (found && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+        return kb;
+    }
+
+    /**
+     * @brief PMD size of transparent hugepages, 0 if THP is disabled
+     */
+    static size_t thp_size() {
+        char buf[64] = {0};
+        FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        if (!f) {
+            return 0;
+        }
+        bool never = fgets(buf, sizeof(buf), f) && strstr(buf, "[never]");
+        fclose(f);
+        if (never) {
+            return 0;
+        }
+
+        size_t pmd = 2 * MB;
+        f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+        if (f) {
+            if (fscanf(f, "%zu", &pmd) != 1) {
+                pmd = 2 * MB;
+            }
+            fclose(f);
+        }
+        return pmd;
+    }
+
+public:
+    /**
+     * @brief Construct a memory based nv_dev
+     * 
+     * @param size size of the mapping
+     * @param opts opts.hugepage selects the hugepage policy, the policy
+     *             actually obtained is reported by hugepage()/pagesize()
+     *             opts.numa_node/opts.numa_interleave bind the mapping 
+     *             before it's touched
+     *             opts.prefault faults in the whole mapping before return
+     */
+    nv_memdev(size_t size, const nv_devopts & opts = nv_devopts()) 
+        : nv_dev("", size), mMapVA(nullptr), mMapLen(0) 
+    {
+        /* use anonymous mmap to create memory based mapping */
+        if(!size) {
+            throw nv_exception("creating memory based mapping with zero size.");
+        }
+        if(opts.mode != NV_OPEN_RDWR) {
+            errno = EINVAL;
+            throw nv_exception("memory based devices are always read-write.");
+        }
+
+        switch (opts.hugepage) {
+        case NV_HUGEPAGE_1G:
+            if (map_hugetlb(GB)) break;
+            /* fall through */
+        case NV_HUGEPAGE_2M:
+            if (map_hugetlb(2 * MB)) break;
+            /* fall through */
+        case NV_HUGEPAGE_THP:
+            if (map_thp()) break;
+            /* fall through */
+        default:
+            mVA = (void*) ::mmap(NULL, size, PROT_READ | PROT_WRITE, 
+                                    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+            if (mVA == MAP_FAILED) {
+                mVA = nullptr;
+                throw nv_exception("failed to mmap /dev/zero.");
+            }
+            mMapVA  = mVA;
+            mMapLen = size;
+        }
+        numa_bind(mMapVA, mMapLen, opts);
+        confirm_thp();
+        if (prefault(opts.prefault, opts.prefault_threads) != 0) {
+            close();
+            throw nv_exception("failed to prefault device.");
+        }
+        mName = uuid();
+    }
+
+    virtual bool close() override {
+        if(mMapVA && mMapLen && ::munmap(mMapVA, mMapLen)) {
+            return false;
+        }
+        mVA     = mMapVA  = nullptr;
+        mSize   = mMapLen = 0;
+        remapped();
+        return true;
+    }
+
+    virtual int flush(void* addr, size_t size) override {
+        UNUSED(addr); UNUSED(size);
+        /* no action taken for memory based device */
+        errno = EINVAL;
+        return -1;
+    }
+
+    virtual int flushv(std::vector<nv_range> & ranges) override {
+        UNUSED(ranges);
+        errno = EINVAL;
+        return -1;
+    }
+
+    virtual bool is_persistent() const override { return false; }
+
+    virtual ~nv_memdev() { close(); }
+
+protected:
+    /**
+     * @brief private anonymous pages read as zeros once dropped
+     */
+    virtual int discard_pages(void* addr, size_t len) override {
+        return ::madvise(addr, len, MADV_DONTNEED);
+    }
+};
+
+/**
+ * @brief an nv_memfddev is an nv_dev backed by shared memory of a memfd
+ *        the fd can be handed to another process (fork or SCM_RIGHTS),
+ *        which adopts it to map the same memory without copying
+ * 
+ */
+class nv_memfddev : public nv_dev {
+protected:
+    int       mFd;               // the memfd
+    size_t    mMapLen;           // length of the mapping
+
+    virtual bool prefault_write() const override { return true; }
+
+    /**
+     * @brief create a memfd of len bytes and map it shared
+     * 
+     * @return true if succ, false with nothing left open if failed
+     */
+    bool create(unsigned flags, size_t len) {
+        mFd = ::memfd_create(mName.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+        if (mFd == -1) {
+            return false;
+        }
+        mMapLen = len;
+        if (ftruncate(mFd, len) == 0 && map()) {
+            return true;
+        }
+        int err = errno;
+        close();
+        errno = err;
+        return false;
+    }
+
+    /**
+     * @brief map the whole memfd shared
+     */
+    bool map() {
+        mVA = ::mmap(NULL, mMapLen, PROT_READ|PROT_WRITE, MAP_SHARED, mFd, 0);
+        if (mVA == MAP_FAILED) {
+            mVA = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief apply NUMA and prefault options onto the new mapping
+     */
+    void setup(const nv_devopts & opts) {
+        numa_bind(mVA, mMapLen, opts);
+        if (prefault(opts.prefault, opts.prefault_threads) != 0) {
+            close();
+            throw nv_exception("failed to prefault device.");
+        }
+    }
+
+public:
+    /**
+     * @brief Construct a new shared memory device
+     * 
+     * @param size size of the device
+     * @param opts opts.hugepage 2M/1G use a hugetlb memfd if hugepages
+     *             are available
+     *             opts.seal forbids anyone to shrink or grow the memfd
+     *             opts.numa_node/numa_interleave/prefault as nv_memdev
+     */
+    nv_memfddev(size_t size, const nv_devopts & opts = nv_devopts()) 
+        : nv_dev(uuid(), size), mFd(-1), mMapLen(0)
+    {
+        if(!size) {
+            throw nv_exception("creating memfd with zero size.");
+        }
+        if(opts.mode != NV_OPEN_RDWR) {
+            errno = EINVAL;
+            throw nv_exception("memory based devices are always read-write.");
+        }
+
+        switch (opts.hugepage) {
+        case NV_HUGEPAGE_1G:
+            if (create(MFD_HUGETLB | (30 << MFD_HUGE_SHIFT), (size + GB - 1) & ~(size_t)(GB - 1))) {
+                mPageSize = GB;
+                mHugePage = NV_HUGEPAGE_1G;
+                break;
+            }
+            /* fall through */
+        case NV_HUGEPAGE_2M:
+            if (create(MFD_HUGETLB | (21 << MFD_HUGE_SHIFT), (size + 2 * MB - 1) & ~(size_t)(2 * MB - 1))) {
+                mPageSize = 2 * MB;
+                mHugePage = NV_HUGEPAGE_2M;
+                break;
+            }
+            /* fall through */
+        default:
+            if (!create(0, size)) {
+                throw nv_exception("failed to create memfd.");
+            }
+        }
+        mSize = size;
+
+        if (opts.seal && 
+            ::fcntl(mFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+            close();
+            throw nv_exception("failed to seal memfd.");
+        }
+        setup(opts);
+    }
+
+    /**
+     * @brief adopt a memfd of another nv_memfddev, possibly received
+     *        from another process, and map it
+     * 
+     * @param fd   the memfd, owned by the new device on success
+     * @param name name of the device, a new uuid if ""
+     * @param opts opts.numa_node/numa_interleave/prefault as nv_memdev
+     */
+    nv_memfddev(int fd, const string & name, const nv_devopts & opts = nv_devopts())
+        : nv_dev(name == "" ? uuid() : name, 0), mFd(-1), mMapLen(0)
+    {
+        struct stat st;
+        if (fd < 0) {
+            errno = EBADF;
+            throw nv_exception("invalid memfd.");
+        }
+        if (::fstat(fd, &st) != 0) {
+            throw nv_exception("failed to stat memfd.");
+        }
+        if (!st.st_size) {
+            errno = EINVAL;
+            throw nv_exception("invalid memfd.");
+        }
+        mFd     = fd;
+        mSize   = mMapLen = st.st_size;
+        if (!map()) {
+            mFd = -1;
+            throw nv_exception("failed to map memfd.");
+        }
+        setup(opts);
+    }
+
+    /**
+     * @brief the memfd, to be passed to other processes
+     */
+    int fd() const { return mFd; }
+
+    virtual bool close() override {
+        if(mVA && mMapLen && ::munmap(mVA, mMapLen)) {
+            return false;
+        }
+        if(mFd != -1) {
+            ::close(mFd);
+        }
+        mFd   = -1;
+        mVA   = nullptr;
+        mSize = mMapLen = 0;
+        remapped();
+        return true;
+    }
+
+    virtual int flush(void* addr, size_t size) override {
+        UNUSED(addr); UNUSED(size);
+        /* no action taken for memory based device */
+        errno = EINVAL;
+        return -1;
+    }
+
+    virtual int flushv(std::vector<nv_range> & ranges) override {
+        UNUSED(ranges);
+        errno = EINVAL;
+        return -1;
+    }
+
+    virtual bool is_persistent() const override { return false; }
+
+    virtual ~nv_memfddev() { close(); }
+
+protected:
+    /**
+     * @brief free the pages from the memfd, for every process mapping it
+     */
+    virtual int discard_pages(void* addr, size_t len) override {
+        if (::madvise(addr, len, MADV_REMOVE) == 0) {
+            return 0;
+        }
+        return ::fallocate(mFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                           (char*)addr - (char*)mVA, len);
+    }
+};
+
+/**
+ * @brief an nvchunk object represents a contiguous region on an NVM device
+ *        that was mapped to a virtual address 
+ * 
+ */
+class nvchunk {
+private:
+GTEST_ONLY(public:)
+    string    mName;         // name of this chunk
+    uint64_t  mFlags;        // flags of this chunk
+    nv_dev*   _pDev;         // the backing device
+    size_t    mOffset;       // offset of this chunk in the device
+    size_t    mSize;         // size of this chunk
+    size_t    mDirtyGran;    // bytes covered by a bit of the dirty bitmap
+    std::atomic<std::atomic<uint64_t>*> mDirty;   // dirty bitmap, allocated on first use
+    std::atomic<bool>   mAsync;                  // ever submitted to nv_flusher
+    std::atomic<bool>   mTracked;                // writes tracked by nv_wrtrack
+    std::mutex          mFlushLock;              // serializes flush_dirty()
+
+    size_t dirty_words() const {
+        return ((mSize + mDirtyGran - 1) / mDirtyGran + 63) / 64;
+    }
+
+    /**
+     * @brief the dirty bitmap, allocated by the first caller
+     */
+    std::atomic<uint64_t>* dirty_map() {
+        std::atomic<uint64_t>* map = mDirty.load(std::memory_order_acquire);
+        if (map) {
+            return map;
+        }
+        size_t n = dirty_words();
+        std::atomic<uint64_t>* fresh = new std::atomic<uint64_t>[n];
+        for (size_t i = 0; i < n; i++) {
+            fresh[i].store(0, std::memory_order_relaxed);
+        }
+        if (!mDirty.compare_exchange_strong(map, fresh, std::memory_order_acq_rel)) {
+            delete [] fresh;
+            return map;
+        }
+        return fresh;
+    }
+
+    /**
+     * @brief write protect the pages of ranges taken from the dirty
+     *        bitmap of a tracked chunk, see nv_wrtrack
+     */
+    static int protect(const std::vector<nv_range> & ranges) {
+        uintptr_t pg = nv_pagesize();
+        for (auto & r : ranges) {
+            uintptr_t b = (uintptr_t)r.addr & ~(pg - 1);
+            uintptr_t e = ((uintptr_t)r.addr + r.size + pg - 1) & ~(pg - 1);
+            if (::mprotect((void*)b, e - b, PROT_READ) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+public:
+    const string& name() const { return mName; }
+
+    /**
+     * @brief the address of the chunk, see nv_dev::va() for devices 
+     *        that are mapped lazily
+     */
+    void*    va () const { 
+        char* base = (char*)_pDev->va();
+        return base ? base + mOffset : nullptr;
+    }
+    size_t size () const { return mSize; }
+    size_t offset() const { return mOffset; }
+    nv_dev*  dev() const { return _pDev; }
+    bool is_nvm () const { return _pDev->is_pmem(); }
+    int  numa_node() const { return _pDev->numa_node(va(), mSize); }
+    int flush() {
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        return base ? _pDev->flush(base + mOffset, mSize) : -1;
+    }
+    int flush( void * addr, size_t size ) { return _pDev->flush(addr, size); }
+
+    /**
+     * @brief write back a range without waiting for it, like pmem_flush()
+     *        drain() waits for all of them like pmem_drain()
+     */
+    int flush_nodrain( void * addr, size_t size ) { return _pDev->flush_nodrain(addr, size); }
+    int drain()                                   { return _pDev->drain(); }
+
+    /**
+     * @brief flush a range together with other threads, see nv_dev::group_flush()
+     */
+    int group_flush( void * addr, size_t size )   { return _pDev->group_flush(addr, size); }
+
+    /**
+     * @brief record that a range of the chunk was modified, so that 
+     *        flush_dirty()/flush_async() write it back
+     *        the range is tracked at page granularity (cache lines on 
+     *        NVM devices), coarser for very large chunks
+     */
+    void mark_dirty(const void* addr, size_t len) {
+        nv_dev::pinned pin(_pDev);
+        if (!pin.va()) {
+            return;
+        }
+        uintptr_t b = (uintptr_t)addr, e = b + len;
+        uintptr_t cb = (uintptr_t)pin.va() + mOffset, ce = cb + mSize;
+        b = std::max(b, cb);
+        e = std::min(e, ce);
+        if (b >= e) {
+            return;
+        }
+
+        std::atomic<uint64_t>* map = dirty_map();
+        size_t first = (b - cb) / mDirtyGran;
+        size_t last  = (e - cb - 1) / mDirtyGran;
+        for (size_t w = first / 64; w <= last / 64; w++) {
+            size_t   lo   = w == first / 64 ? first % 64 : 0;
+            size_t   hi   = w == last / 64  ? last % 64  : 63;
+            uint64_t bits = (hi == 63 ? ~0ull : ((1ull << (hi + 1)) - 1)) & ~((1ull << lo) - 1);
+            if ((map[w].load(std::memory_order_relaxed) & bits) != bits) {
+                map[w].fetch_or(bits, std::memory_order_release);
+            }
+        }
+    }
+
+    /**
+     * @brief number of bytes marked dirty and not flushed yet
+     */
+    size_t dirty_bytes() const {
+        std::atomic<uint64_t>* map = mDirty.load(std::memory_order_acquire);
+        size_t n = 0;
+        for (size_t w = 0; map && w < dirty_words(); w++) {
+            n += __builtin_popcountll(map[w].load(std::memory_order_relaxed));
+        }
+        return std::min(n * mDirtyGran, mSize);
+    }
+
+    /**
+     * @brief write back the dirty ranges of the chunk as one batch and
+     *        clear them, ranges that fail to flush stay dirty
+     *        calls are serialized, so a call that finds the ranges taken
+     *        by another one returns only once they are durable
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int flush_dirty() {
+        std::lock_guard<std::mutex> lk(mFlushLock);
+        std::atomic<uint64_t>* map = mDirty.load(std::memory_order_acquire);
+        if (!map) {
+            return 0;
+        }
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        if (!base) {
+            return -1;
+        }
+        base += mOffset;
+
+        std::vector<nv_range> ranges;
+        size_t nbits = (mSize + mDirtyGran - 1) / mDirtyGran;
+        for (size_t w = 0; w < dirty_words(); w++) {
+            if (!map[w].load(std::memory_order_relaxed)) {
+                continue;
+            }
+            uint64_t bits = map[w].exchange(0, std::memory_order_acquire);
+            while (bits) {
+                size_t lo = __builtin_ctzll(bits);
+                size_t hi = lo;
+                while (hi < 63 && (bits & (1ull << (hi + 1)))) {
+                    hi++;
+                }
+                bits &= hi == 63 ? 0 : ~0ull << (hi + 1);
+
+                size_t b = w * 64 + lo;
+                size_t e = std::min(w * 64 + hi + 1, nbits);
+                char*  a = base + b * mDirtyGran;
+                size_t n = std::min((e - b) * mDirtyGran, mSize - b * mDirtyGran);
+                if (!ranges.empty() && 
+                    (char*)ranges.back().addr + ranges.back().size == a) {
+                    ranges.back().size += n;
+                } else {
+                    ranges.push_back({ a, n });
+                }
+            }
+        }
+        if (ranges.empty()) {
+            return 0;
+        }
+        if (mTracked && protect(ranges) != 0) {
+            int err = errno;
+            for (auto & r : ranges) {
+                mark_dirty(r.addr, r.size);
+            }
+            errno = err;
+            return -1;
+        }
+
+        std::vector<nv_range> batch(ranges);
+        if (_pDev->flushv(batch) != 0) {
+            int err = errno;
+            for (auto & r : ranges) {
+                mark_dirty(r.addr, r.size);
+            }
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief let the writes to the chunk mark it dirty, so that 
+     *        flush_dirty() writes them back without any mark_dirty(),
+     *        see nv_wrtrack
+     *        the chunk must be page aligned, on a writable device that
+     *        isn't lazy
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int track_writes();
+    void untrack_writes();
+
+    /**
+     * @brief write back the dirty ranges on the background flusher
+     * 
+     * @return std::future<int> becomes ready with 0 once every range 
+     *         marked dirty before the call is durable, or with the errno
+     *         of the flush_dirty() that failed
+     */
+    std::future<int> flush_async();
+
+    /**
+     * @brief copy len bytes from src to offset of the chunk and persist
+     *        them, instead of memcpy to va() followed by flush()
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int write(off_t offset, const void* src, size_t len) {
+        if (offset < 0 || offset + len > mSize) {
+            errno = EINVAL;
+            return -1;
+        }
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        return base ? _pDev->write(base + mOffset + offset, src, len) : -1;
+    }
+
+    /**
+     * @brief tell the kernel how [offset, offset+len) of the chunk will
+     *        be accessed, see nv_dev::advise()
+     * 
+     * @param how    the access pattern
+     * @param offset offset of the range
+     * @param len    length of the range, 0 up to the end of the chunk
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int advise(nv_advice how, off_t offset = 0, size_t len = 0) {
+        if (offset < 0 || (size_t)offset >= mSize || offset + len > mSize) {
+            errno = EINVAL;
+            return -1;
+        }
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        return base ? _pDev->advise(base + mOffset + offset, len ? len : mSize - offset, how) : -1;
+    }
+
+    /**
+     * @brief read the chunk, or hot ranges of it, ahead in the background,
+     *        see nv_dev::warmup()
+     * 
+     * @param hot ranges within the chunk, the whole chunk if empty
+     */
+    std::shared_ptr<nv_warmup> warmup(const std::vector<nv_range> & hot = std::vector<nv_range>()) {
+        std::vector<nv_range> ranges(hot);
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        if (!base) {
+            return nullptr;
+        }
+        base += mOffset;
+        for (auto & r : ranges) {
+            if ((char*)r.addr < base || (char*)r.addr + r.size > base + mSize) {
+                errno = EINVAL;
+                return nullptr;
+            }
+        }
+        if (ranges.empty()) {
+            ranges.push_back({ base, mSize });
+        }
+        return _pDev->warmup(ranges);
+    }
+
+    /**
+     * @brief release [offset, offset+len) of the chunk, see nv_dev::discard()
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int discard(off_t offset, size_t len) {
+        if (offset < 0 || offset + len > mSize) {
+            errno = EINVAL;
+            return -1;
+        }
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        return base ? _pDev->discard(base + mOffset + offset, len) : -1;
+    }
+
+    /**
+     * @brief copy len bytes at other_off of another chunk to offset of
+     *        this chunk and persist them, the chunks may overlap
+     * 
+     * @return int 0 if succ, else -1 with errno set
+     */
+    int copy_from(const nvchunk & other, off_t offset, off_t other_off, size_t len) {
+        if (other_off < 0 || other_off + len > other.size()) {
+            errno = EINVAL;
+            return -1;
+        }
+        nv_dev::pinned pin(other.dev());
+        char* src = (char*)pin.va();
+        return src ? write(offset, src + other.offset() + other_off, len) : -1;
+    }
+
+    nvchunk(const string & name, nv_dev* dev, off_t off=0, size_t size=0)
+        : mName(name), mFlags(0), _pDev(dev), mOffset(off), mSize(size),
+          mDirtyGran(0), mDirty(nullptr), mAsync(false), mTracked(false)
+    {
+        if(!_pDev) {
+            throw nv_exception("null dev.");
+        }
+        if(off % _pDev->align()) {
+            errno = EINVAL;
+            throw nv_exception("misaligned chunk offset.");
+        }
+        if(!mSize) {
+            mSize = _pDev->size();
+        }
+        mDirtyGran = _pDev->is_pmem() ? NV_CACHELINE : nv_pagesize();
+        while (mSize / mDirtyGran > NV_DIRTY_BITS) {
+            mDirtyGran <<= 1;
+        }
+        if(!_pDev->get()) {
+            errno = ENODEV;
+            throw nv_exception("device closed.");
+        }
+    }
+
+    ~nvchunk();
+
+    /**
+     * @brief zero the chunk, not the whole backing device
+     */
+    int zero(nv_zero how = NV_ZERO_AUTO, unsigned nthreads = 0) {
+        nv_dev::pinned pin(_pDev);
+        char* base = (char*)pin.va();
+        return base ? _pDev->zero(base + mOffset, mSize, how, nthreads) : -1;
+    }
+    int zero(void* addr, size_t size, nv_zero how = NV_ZERO_AUTO, unsigned nthreads = 0) {
+        return _pDev->zero(addr, size, how, nthreads);
+    }
+
+    template <typename T>
+    class mapper {
+    private:
+        nvchunk*  mParent;
+        T*        mT;
+        size_t    mNumElements;
+    public:
+        mapper(nvchunk* parent) : mParent(parent), mNumElements(0) {
+            mNumElements = mParent->size() / sizeof(T);
+            mT = (T*)mParent->va();
+        }
+        T & operator [] (size_t index) {
+            return mT [index];
+        }
+
+        void flush( T *item ) {
+            mParent->flush( (void*) item, sizeof(T) );
+        }
+
+        void flush( size_t index ) {
+            mParent->flush( (void*) & mT[index], sizeof(T) );
+        }
+
+        /**
+         * @brief assign an element and mark it dirty
+         */
+        void set( size_t index, const T & v ) {
+            mT[index] = v;
+            mParent->mark_dirty( (void*) & mT[index], sizeof(T) );
+        }
+
+        void mark_dirty( size_t index ) {
+            mParent->mark_dirty( (void*) & mT[index], sizeof(T) );
+        }
+
+        void flush_nodrain( size_t index ) {
+            mParent->flush_nodrain( (void*) & mT[index], sizeof(T) );
+        }
+
+        void drain() {
+            mParent->drain();
+        }
+
+        T* operator->() {
+            return mT;
+        }
+    };
+
+    template <typename T>
+    mapper<T> getmapper() {
+        return mapper<T>(this);
+    }
+};
+
+
+/**
+ * @brief a persist batch collects ranges of any chunks and devices and
+ *        commits them with one nv_dev::flushv() per device, that is one 
+ *        drain per NVM device and one msync per run of pages otherwise
+ *        ranges of memory based devices have nothing to persist and
+ *        are ignored
+ * 
+ */
+class nv_persistbatch {
+private:
+GTEST_ONLY(public:)
+    std::map<nv_dev*, std::vector<nv_range>> mRanges;   // ranges by device
+    size_t mCount;                                      // number of ranges
+
+public:
+    nv_persistbatch() : mCount(0) {}
+
+    void add(nv_dev* dev, void* addr, size_t size) {
+        if (!dev->is_persistent() || !size) {
+            return;
+        }
+        mRanges[dev].push_back({ addr, size });
+        mCount++;
+    }
+    void add(nvchunk* pc, void* addr, size_t size) {
+        add(pc->dev(), addr, size);
+    }
+    void add(nvchunk* pc) {
+        add(pc->dev(), pc->va(), pc->size());
+    }
+
+    size_t size() const { return mCount; }
+    size_t ndevs() const { return mRanges.size(); }
+    void clear() {
+        mRanges.clear();
+        mCount = 0;
+    }
+
+    /**
+     * @brief persist all ranges and clear the batch
+     * 
+     * @return int 0 if succ, -1 with errno set if any device failed, the
+     *             other devices are still committed
+     */
+    int commit() {
+        int rt = 0, err = 0;
+        for (auto & dr : mRanges) {
+            if (dr.first->flushv(dr.second) != 0) {
+                rt  = -1;
+                err = errno;
+            }
+        }
+        clear();
+        errno = err ? err : errno;
+        return rt;
+    }
+};
+
+/**
+ * @brief the background flusher writes back dirty ranges of chunks
+ *        off the callers' threads
+ *        requests queued for the same chunk are served by one flush
+ * 
+ */
+class nv_flusher : public Singleton<nv_flusher>
+{
+private:
+GTEST_ONLY(public:)
+    struct request {
+        nvchunk*            chunk;
+        std::promise<int>   done;
+    };
+    std::mutex              mLock;
+    std::condition_variable mCond;          // signals new requests
+    std::condition_variable mIdle;          // signals finished requests
+    std::deque<request>     mQueue;         // pending requests
+    std::multiset<nvchunk*> mBusy;          // chunks queued or being flushed
+    std::thread             mThread;        // the flusher thread
+    bool                    mStop;
+
+    void run() {
+        std::unique_lock<std::mutex> lk(mLock);
+        while (true) {
+            mCond.wait(lk, [this] { return mStop || !mQueue.empty(); });
+            if (mQueue.empty()) {
+                return;
+            }
+            std::deque<request> batch;
+            batch.swap(mQueue);
+            lk.unlock();
+
+            /* one flush per chunk serves all its requests in the batch */
+            std::map<nvchunk*, int> results;
+            for (auto & r : batch) {
+                auto it = results.find(r.chunk);
+                if (it == results.end()) {
+                    int rt = r.chunk->flush_dirty();
+                    it = results.insert(std::make_pair(r.chunk, rt ? errno : 0)).first;
+                }
+                r.done.set_value(it->second);
+            }
+
+            lk.lock();
+            for (auto & r : batch) {
+                mBusy.erase(mBusy.find(r.chunk));
+            }
+            mIdle.notify_all();
+        }
+    }
+
+public:
+    nv_flusher() : mStop(false) {}
+
+    ~nv_flusher() {
+        {
+            std::lock_guard<std::mutex> lk(mLock);
+            mStop = true;
+        }
+        mCond.notify_all();
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    /**
+     * @brief queue a chunk to write back its dirty ranges
+     * 
+     * @return std::future<int> result of the flush, 0 or an errno
+     */
+    std::future<int> submit(nvchunk* pc) {
+        std::lock_guard<std::mutex> lk(mLock);
+        if (!mThread.joinable()) {
+            mThread = std::thread(&nv_flusher::run, this);
+        }
+        mQueue.push_back(request());
+        mQueue.back().chunk = pc;
+        mBusy.insert(pc);
+        mCond.notify_one();
+        return mQueue.back().done.get_future();
+    }
+
+    /**
+     * @brief wait until no request of a chunk is pending
+     */
+    void wait(nvchunk* pc) {
+        std::unique_lock<std::mutex> lk(mLock);
+        mIdle.wait(lk, [this, pc] { return mBusy.find(pc) == mBusy.end(); });
+    }
+};
+
+/**
+ * @brief finds the pages written to tracked chunks by write protecting
+ *        them: the first write to a protected page faults, the SIGSEGV
+ *        handler makes the page writable, marks it in the chunk's dirty
+ *        bitmap and lets the write through, flush_dirty() protects the
+ *        pages it takes from the bitmap again before flushing them
+ *        
+ *        the handler unprotects a page before marking it, flush_dirty()
+ *        takes the bits before protecting the pages, so a writable page
+ *        is always marked or about to be, and a write landing after the
+ *        flush protected its page faults again: no write is missed
+ *        faults elsewhere go to the SIGSEGV handler installed before,
+ *        a handler installed later must chain to it while chunks are 
+ *        tracked, it is installed again by the next track_writes()
+ *        the kernel can't write into a protected page for a system call
+ *        (EFAULT), buffers handed to read() and the like must be written
+ *        or mark_dirty()'ed first
+ * 
+ */
+class nv_wrtrack : public Singleton<nv_wrtrack>
+{
+private:
+GTEST_ONLY(public:)
+    struct slot {
+        std::atomic<uintptr_t>  begin;      // 0 if free
+        uintptr_t               end;
+        std::atomic<uint64_t>*  map;        // the chunk's dirty bitmap
+        size_t                  gran;       // bytes per bit of map
+        nvchunk*                chunk;
+    };
+    static const size_t NSLOTS = 64;
+
+    slot                mSlots[NSLOTS];     // read by the handler, lock free
+    std::atomic<int>    mActive;            // handlers running
+    std::mutex          mLock;              // serializes track/untrack
+    struct sigaction    mPrev;              // handler installed before
+
+    static void on_fault(int sig, siginfo_t* si, void* uc) {
+        nv_wrtrack & wt = instance();
+        uintptr_t    a  = (uintptr_t)si->si_addr;
+        bool         hit = false;
+
+        wt.mActive.fetch_add(1);
+        for (size_t i = 0; i < NSLOTS && !hit; i++) {
+            slot &    s = wt.mSlots[i];
+            uintptr_t b = s.begin.load();
+            if (!b || a < b || a >= s.end) {
+                continue;
+            }
+            uintptr_t pg = nv_pagesize();
+            uintptr_t p  = a & ~(pg - 1);
+            hit = ::mprotect((void*)p, pg, PROT_READ | PROT_WRITE) == 0;
+            if (hit) {
+                for (size_t bit = (p - b) / s.gran; bit <= (p + pg - 1 - b) / s.gran; bit++) {
+                    s.map[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_release);
+                }
+            }
+        }
+        wt.mActive.fetch_sub(1);
+        if (hit) {
+            return;
+        }
+
+        if (wt.mPrev.sa_flags & SA_SIGINFO) {
+            wt.mPrev.sa_sigaction(sig, si, uc);
+        }
+        else if (wt.mPrev.sa_handler != SIG_DFL && wt.mPrev.sa_handler != SIG_IGN) {
+            wt.mPrev.sa_handler(sig);
         }
         else {
-            rt = (addr && size) ? pmem_msync(addr, size) : 
-                                  pmem_msync(mVA, mSize);
+            /* the fault happens again and takes the default action */
+            ::signal(sig, SIG_DFL);
         }
-        return rt;
-    }
-    
-    const string & path() {
-        return mName;
     }
 
-    virtual ~nv_filedev() { close(); }
-
-};
-
-/**
- * @brief an nv_memdev is an nv_dev backed by memory
- * 
- */
-class nv_memdev : public nv_dev {
 public:
-    nv_memdev(size_t size) : nv_dev("", size) {
-        /* use anonymous mmap to create memory based mapping */
-        if(!size) {
-            throw nv_exception("creating memory based mapping with zero size.");
+    nv_wrtrack() : mActive(0) {
+        for (auto & s : mSlots) {
+            s.begin.store(0, std::memory_order_relaxed);
         }
+    }
 
-        mVA = (void*) ::mmap(NULL, size, PROT_READ | PROT_WRITE, 
-                                MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-        if (mVA == MAP_FAILED) {
-            throw nv_exception("failed to mmap /dev/zero.");
+    /**
+     * @brief protect a chunk and track its writes
+     * 
+     * @return int 0 if succ, else -1 with errno set, 
+     *             ENOSPC if too many chunks are tracked
+     */
+    int track(nvchunk* pc, std::atomic<uint64_t>* map, size_t gran) {
+        std::lock_guard<std::mutex> lk(mLock);
+        struct sigaction cur;
+        if (::sigaction(SIGSEGV, nullptr, &cur) != 0) {
+            return -1;
         }
-        mName = uuid();
+        if (!(cur.sa_flags & SA_SIGINFO) || cur.sa_sigaction != on_fault) {
+            /* not installed yet, or replaced by a handler that didn't
+               chain to it */
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = on_fault;
+            sa.sa_flags     = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            if (::sigaction(SIGSEGV, &sa, &mPrev) != 0) {
+                return -1;
+            }
+        }
+        for (auto & s : mSlots) {
+            if (s.begin.load()) {
+                continue;
+            }
+            uintptr_t b = (uintptr_t)pc->va();
+            s.end   = b + pc->size();
+            s.map   = map;
+            s.gran  = gran;
+            s.chunk = pc;
+            s.begin.store(b);
+            if (::mprotect((void*)b, pc->size(), PROT_READ) != 0) {
+                int err = errno;
+                s.begin.store(0);
+                errno = err;
+                return -1;
+            }
+            return 0;
+        }
+        errno = ENOSPC;
+        return -1;
     }
 
-    virtual bool close() override {
-        if(mVA && mSize && ::munmap(mVA, mSize)) {
-            return false;
+    /**
+     * @brief unprotect a chunk and stop tracking it, returns once no 
+     *        handler can still use it
+     */
+    void untrack(nvchunk* pc) {
+        std::lock_guard<std::mutex> lk(mLock);
+        for (auto & s : mSlots) {
+            uintptr_t b = s.begin.load();
+            if (!b || s.chunk != pc) {
+                continue;
+            }
+            ::mprotect((void*)b, s.end - b, PROT_READ | PROT_WRITE);
+            s.begin.store(0);
+            while (mActive.load()) {
+                std::this_thread::yield();
+            }
         }
-        mVA   = nullptr;
-        mSize = 0;
-        return true;
     }
 
-    virtual int flush(void* addr, size_t size) override {
-        UNUSED(addr); UNUSED(size);
-        /* no action taken for memory based device */
+    size_t ntracked() {
+        std::lock_guard<std::mutex> lk(mLock);
+        size_t n = 0;
+        for (auto & s : mSlots) {
+            n += s.begin.load() != 0;
+        }
+        return n;
+    }
+};
+
+inline int nvchunk::track_writes() {
+    uintptr_t pg = nv_pagesize();
+    if (mTracked) {
+        return 0;
+    }
+    if (_pDev->mode() != NV_OPEN_RDWR) {
+        errno = EROFS;
+        return -1;
+    }
+    if (_pDev->is_lazy()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!va() || ((uintptr_t)va() | mSize) & (pg - 1)) {
         errno = EINVAL;
         return -1;
     }
+    if (nv_wrtrack::instance().track(this, dirty_map(), mDirtyGran) != 0) {
+        return -1;
+    }
+    mTracked = true;
+    return 0;
+}
 
-    virtual ~nv_memdev() { close(); }
-};
+inline void nvchunk::untrack_writes() {
+    if (mTracked) {
+        nv_wrtrack::instance().untrack(this);
+        mTracked = false;
+    }
+}
+
+inline std::future<int> nvchunk::flush_async() {
+    mAsync = true;
+    return nv_flusher::instance().submit(this);
+}
+
+inline nvchunk::~nvchunk() {
+    untrack_writes();
+    if (mAsync) {
+        nv_flusher::instance().wait(this);
+    }
+    delete [] mDirty.load();
+    _pDev->put();
+}
 
 /**
- * @brief an nvchunk object represents a contiguous region on an NVM device
- *        that was mapped to a virtual address 
+ * @brief a concurrent hash index from names to objects
+ *        lookups take no lock: they walk immutable nodes inside an 
+ *        nv_ebr guard, writers lock one of NSHARDS shards, each shard
+ *        has its own bucket table which is doubled when it fills up
+ *        unlinked nodes and replaced tables are retired to nv_ebr, the
+ *        indexed objects themselves are owned by the caller
  * 
+ * @tparam T type of the indexed objects
  */
-class nvchunk {
-private:
-GTEST_ONLY(public:)
-    string    mName;         // name of this chunk
-    uint64_t  mFlags;        // flags of this chunk
-    nv_dev*   _pDev;         // the backing device
-    void*     mVA;           // starting address of this chunk
-    size_t    mSize;         // size of this chunk
-public:
-    const string& name() const { return mName; }
-    void*    va () const { return mVA; }
-    size_t size () const { return mSize; }
-    bool is_nvm () const { return _pDev->is_pmem(); }
-    int flush()                           { return _pDev->flush(mVA, mSize); }
-    int flush( void * addr, size_t size ) { return _pDev->flush(addr, size); }
-
-    nvchunk(const string & name, nv_dev* dev, off_t off=0, size_t size=0)
-        : mName(name), mFlags(0), _pDev(dev), mVA(nullptr), mSize(size) 
-    {
-        if(!_pDev) {
-            throw nv_exception("null dev.");
+template <typename T>
+class nv_registry {
+    struct node {
+        string              key;
+        T*                  val;
+        std::atomic<node*>  next;
+        node(const string & k, T* v, node* n) : key(k), val(v), next(n) {}
+    };
+    struct table {
+        size_t              nbuckets;   // power of 2
+        std::atomic<node*>* buckets;
+        explicit table(size_t n) : nbuckets(n), buckets(new std::atomic<node*>[n]) {
+            for( size_t i = 0; i < n; i++ ) {
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
         }
-        mVA = (char*)_pDev->va() + off;
-        if(!mSize) {
-            mSize = _pDev->size();
+        ~table() { delete [] buckets; }
+    };
+    struct alignas(NV_CACHELINE) shard {
+        std::mutex          lock;       // serializes writers
+        std::atomic<table*> tab;
+        size_t              count;      // with lock held
+    };
+    static const size_t NSHARDS = 64;
+
+    shard                   mShards[NSHARDS];
+    std::atomic<size_t>     mCount;
+
+    static size_t hash(const string & key) {
+        return std::hash<string>()(key);
+    }
+    shard & shard_of(size_t h) {
+        return mShards[h % NSHARDS];
+    }
+    static std::atomic<node*> & bucket_of(table* t, size_t h) {
+        return t->buckets[(h / NSHARDS) & (t->nbuckets - 1)];
+    }
+
+    /**
+     * @brief double the table of a shard, with its lock held
+     *        readers of the old table still see every node of it
+     */
+    void rehash(shard & s) {
+        table* ot = s.tab.load(std::memory_order_relaxed);
+        table* nt = new table(ot->nbuckets * 2);
+        for( size_t i = 0; i < ot->nbuckets; i++ ) {
+            for( node* n = ot->buckets[i].load(std::memory_order_relaxed); n; 
+                 n = n->next.load(std::memory_order_relaxed) ) {
+                std::atomic<node*> & b = bucket_of(nt, hash(n->key));
+                b.store(new node(n->key, n->val, b.load(std::memory_order_relaxed)), 
+                        std::memory_order_relaxed);
+            }
         }
+        s.tab.store(nt, std::memory_order_release);
+        nv_ebr::instance().retire([ot]() {
+            for( size_t i = 0; i < ot->nbuckets; i++ ) {
+                node* n = ot->buckets[i].load(std::memory_order_relaxed);
+                while( n ) {
+                    node* next = n->next.load(std::memory_order_relaxed);
+                    delete n;
+                    n = next;
+                }
+            }
+            delete ot;
+        });
     }
 
-    void zero() {
-        _pDev->zero();
+public:
+    nv_registry() : mCount(0) {
+        for( auto & s : mShards ) {
+            s.tab.store(new table(4), std::memory_order_relaxed);
+            s.count = 0;
+        }
     }
-    void zero(void* addr, size_t size) {
-        _pDev->zero(addr, size);
+    ~nv_registry() {
+        for( auto & s : mShards ) {
+            table* t = s.tab.load(std::memory_order_relaxed);
+            for( size_t i = 0; i < t->nbuckets; i++ ) {
+                node* n = t->buckets[i].load(std::memory_order_relaxed);
+                while( n ) {
+                    node* next = n->next.load(std::memory_order_relaxed);
+                    delete n;
+                    n = next;
+                }
+            }
+            delete t;
+        }
     }
+    nv_registry(const nv_registry &)        = delete;
+    void operator=(const nv_registry &)     = delete;
 
-    template <typename T>
-    class mapper {
-    private:
-        nvchunk*  mParent;
-        T*        mT;
-        size_t    mNumElements;
-    public:
-        mapper(nvchunk* parent) : mParent(parent), mNumElements(0) {
-            mNumElements = mParent->size() / sizeof(T);
-            mT = (T*)mParent->va();
-        }
-        T & operator [] (size_t index) {
-            return mT [index];
+    /**
+     * @brief look up an object, lock free
+     *        the object is only safe to use while the caller holds an
+     *        nv_ebr guard taken before the call, the guard inside ends
+     *        with the call and a concurrent remove may retire the object
+     * 
+     * @param key name of the object
+     * @return T* the object, nullptr if not found
+     */
+    T* get(const string & key) {
+        size_t h = hash(key);
+        nv_ebr::guard g;
+        table* t = shard_of(h).tab.load(std::memory_order_acquire);
+        for( node* n = bucket_of(t, h).load(std::memory_order_acquire); n; 
+             n = n->next.load(std::memory_order_acquire) ) {
+            if( n->key == key ) {
+                return n->val;
+            }
         }
+        return nullptr;
+    }
 
-        void flush( T *item ) {
-            mParent->flush( (void*) item, sizeof(T) );
+    /**
+     * @brief add an object if its name isn't indexed yet
+     * 
+     * @param key name of the object
+     * @param val the object
+     * @return T* val if added, else the object already indexed by key
+     */
+    T* insert(const string & key, T* val) {
+        size_t h = hash(key);
+        shard & s = shard_of(h);
+        std::lock_guard<std::mutex> lk(s.lock);
+        table* t = s.tab.load(std::memory_order_relaxed);
+        std::atomic<node*> & b = bucket_of(t, h);
+        for( node* n = b.load(std::memory_order_relaxed); n; 
+             n = n->next.load(std::memory_order_relaxed) ) {
+            if( n->key == key ) {
+                return n->val;
+            }
         }
+        b.store(new node(key, val, b.load(std::memory_order_relaxed)), std::memory_order_release);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        if( ++s.count > t->nbuckets * 2 ) {
+            rehash(s);
+        }
+        return val;
+    }
 
-        void flush( size_t index ) {
-            mParent->flush( (void*) & mT[index], sizeof(T) );
+    /**
+     * @brief remove an object from the index, readers may still see it
+     *        until their guards end
+     * 
+     * @param key name of the object
+     * @return T* the object removed, nullptr if not found
+     */
+    T* remove(const string & key) {
+        size_t h = hash(key);
+        shard & s = shard_of(h);
+        std::lock_guard<std::mutex> lk(s.lock);
+        table* t = s.tab.load(std::memory_order_relaxed);
+        std::atomic<node*>* prev = &bucket_of(t, h);
+        for( node* n = prev->load(std::memory_order_relaxed); n; 
+             n = n->next.load(std::memory_order_relaxed) ) {
+            if( n->key == key ) {
+                T* val = n->val;
+                prev->store(n->next.load(std::memory_order_relaxed), std::memory_order_release);
+                s.count--;
+                mCount.fetch_sub(1, std::memory_order_relaxed);
+                nv_ebr::instance().retire([n]() { delete n; });
+                return val;
+            }
+            prev = &n->next;
         }
+        return nullptr;
+    }
 
-        T* operator->() {
-            return mT;
+    /**
+     * @brief call f on every indexed object until it returns false,
+     *        objects added or removed meanwhile may or may not be seen
+     * 
+     * @param f bool(const string & key, T* val)
+     */
+    template <typename F>
+    void for_each(F f) {
+        nv_ebr::guard g;
+        for( auto & s : mShards ) {
+            table* t = s.tab.load(std::memory_order_acquire);
+            for( size_t i = 0; i < t->nbuckets; i++ ) {
+                for( node* n = t->buckets[i].load(std::memory_order_acquire); n; 
+                     n = n->next.load(std::memory_order_acquire) ) {
+                    if( !f(n->key, n->val) ) {
+                        return;
+                    }
+                }
+            }
         }
-    };
+    }
 
-    template <typename T>
-    mapper<T> getmapper() {
-        return mapper<T>(this);
+    size_t size() const {
+        return mCount.load(std::memory_order_relaxed);
     }
 };
 
+/**
+ * @brief a chunk to open with NVM::openChunks(), the arguments of 
+ *        NVM::openChunk()
+ * 
+ */
+struct nv_chunkspec {
+    string      name;           // name of the chunk
+    string      path;           // path of the device, "" for memory
+    off_t       offset;         // offset within the device
+    size_t      size;           // size of the chunk, 0 for the whole device
+    nv_devopts  opts;           // options to open the device with
+
+    nv_chunkspec(const string & name, const string & path = "", off_t offset = 0, 
+                 size_t size = 0, const nv_devopts & opts = nv_devopts())
+        : name(name), path(path), offset(offset), size(size), opts(opts) {}
+};
+
+/**
+ * @brief the result of opening an nv_chunkspec
+ * 
+ */
+struct nv_chunkresult {
+    nvchunk*    chunk;          // the chunk, nullptr if failed
+    int         err;            // errno if failed
+};
 
 /**
  * @brief nv manager, manages multiple chunks on NVM devices
@@ -355,52 +4205,63 @@ class NVM : public Singleton<NVM>
 {
 private:
 GTEST_ONLY(public:)
-    std::vector<nvchunk*> mChunks;        // NVM chunks
-    std::vector<nv_dev*>  mDevs;          // NVM devices
+    nv_registry<nvchunk>  mChunks;        // NVM chunks by name
+    nv_registry<nv_dev>   mDevs;          // NVM devices by name
 public:
 
     /**
      * @brief create or open a new nv_dev object and add it to mDevs
+     *        if another thread opens the same path meanwhile, the 
+     *        device opened first is kept
      *        if path is "", create a private memory based nv_dev
+     *        (a shared memfd based nv_dev if opts.shared)
      *        if path isn't "", create a file based nv_dev
      *        if the file specified by path doesn't exist, create a new file
      * 
      * @param path a file path, or "" if the device is memory based
      * @param size size of the nv_dev
-     * @return nv_dev* the address of nv_dev
-     */
-    nv_dev* openDev(const string & path, size_t size=0) {
-        if( path != "" ) {
-            // find existing backing dev
-            for( nv_dev* pd : mDevs ) {
-                if(pd->name() == path) {
-                    return pd;
-                }
+     * @param opts options to open a new nv_dev, ignored if the device
+     *             is already open except opts.mode, which must match
+     * @return nv_dev* the address of nv_dev, nullptr if failed
+     *         the device can be closed by another thread at any time,
+     *         hold an nv_ebr::guard until a chunk is mapped on it
+     */
+    nv_dev* openDev(const string & path, size_t size=0, 
+                    const nv_devopts & opts = nv_devopts()) {
+        nv_ebr::guard g;
+        // find existing backing dev
+        nv_dev* pd = path != "" ? mDevs.get(path) : nullptr;
+        if( !pd ) {
+            // no existing dev, open a new dev
+            nv_dev* pn = nv_dev::open(path, size, false, opts);
+            if( !pn ) {
+                return nullptr;
+            }
+            pd = mDevs.insert(pn->name(), pn);
+            if( pd != pn ) {
+                pn->close();
+                delete pn;
             }
         }
-        // no existing dev, open a new dev
-        nv_dev* pd = nv_dev::open(path, size);
-        if( pd ) {
-            mDevs.push_back(pd);
+        if( pd->mode() != opts.mode ) {
+            errno = EBUSY;
+            return nullptr;
         }
         return pd;
     }
 
     /**
-     * @brief close an nv_dev
+     * @brief close an nv_dev, it can't be found by name any more
+     *        chunks mapped on it keep it mapped until they are unmapped,
+     *        then it's closed off the caller's thread once no reader can 
+     *        reach it, see nv_dev::put()
      * 
      * @param name name of the nv_dev to be closed
      */
     void closeDev( const string & name ) {
-        nv_dev* pd = getDev(name);
+        nv_dev* pd = mDevs.remove(name);
         if(pd) {
-            pd->close();
-            for( auto itr = mDevs.begin(); itr != mDevs.end(); itr++ ) {
-                if((*itr)->name() == name) {
-                    mDevs.erase(itr);
-                    break;
-                }
-            }
+            pd->put();
         }
     }
 
@@ -411,7 +4272,9 @@ public:
      * @param dev         nv_dev backing device
      * @param off         offset of the chunk from beginning of dev
      * @param size        size of the chunk
-     * @return nvchunk*   a pointer to the newly created nvchunk
+     * @return nvchunk*   a pointer to the newly created nvchunk, 
+     *                    nullptr if failed, errno is EEXIST if a chunk of
+     *                    the name exists, ENODEV if dev was closed
      */
     nvchunk* mapChunk(const string & name, nv_dev* dev, 
                         off_t off=0, size_t size=0)
@@ -424,40 +4287,67 @@ public:
         catch (nv_exception & e) {
             return nullptr;
         }
-        mChunks.push_back(pc);
+        if( mChunks.insert(name, pc) != pc ) {
+            delete pc;
+            errno = EEXIST;
+            return nullptr;
+        }
+        nv_addrindex::instance().add(pc, dev, pc->offset(), pc->size());
         return pc;
     }
 
     /**
      * @brief Get the existing nvchunk pointer of the given name
+     *        a concurrent closeChunk() frees the chunk once no nv_ebr
+     *        guard is held, hold one across the call and every use
+     *        of the pointer:
+     *            nv_ebr::guard g;
+     *            nvchunk* pc = NVM::instance().getChunk(name);
      * 
      * @param name 
-     * @return nvchunk* 
+     * @return nvchunk* the chunk, valid while the caller's guard is held,
+     *         nullptr if not found
      */
     nvchunk* getChunk(const string & name) {
-        // check existing chunks with the same name
-        // return existing chunk if found
-        for(nvchunk* pc : mChunks ) {
-            if(pc->name() == name) {
-                return pc;
-            }
+        return mChunks.get(name);
+    }
+
+    /**
+     * @brief adopt a shared memory device from the memfd of an 
+     *        nv_memfddev, e.g. one received from another process
+     * 
+     * @param fd   the memfd, owned by the new nv_dev on success
+     * @param name name of the new nv_dev, a new uuid if ""
+     * @return nv_dev* the address of nv_dev, nullptr if failed
+     */
+    nv_dev* adoptDev(int fd, const string & name = "") {
+        nv_dev* pd;
+        try {
+            pd = new nv_memfddev(fd, name);
         }
-        return nullptr;
+        catch (nv_exception & e) {
+            return nullptr;
+        }
+        if( mDevs.insert(pd->name(), pd) != pd ) {
+            pd->close();
+            delete pd;
+            errno = EEXIST;
+            return nullptr;
+        }
+        return pd;
     }
 
     /**
      * @brief Get the nv_dev object in mDevs according to name
      * 
+     *        as with getChunk(), hold an nv_ebr guard across the call
+     *        and every use of the pointer
+     * 
      * @param name the name of nv_dev
      * @return nv_dev* a pointer to nv_dev if found, else nullptr
      */
     nv_dev* getDev(const string & name) {
-        for( nv_dev *pd : mDevs ) {
-            if( pd->name() == name ) {
-                return pd;
-            }
-        }
-        return nullptr;
+        return mDevs.get(name);
     }
 
     /**
@@ -475,47 +4365,221 @@ public:
      * @param size   size of the chunk, size must be greater or equal to the 
      *               backing device size
      *               if size == 0, use whole backing device as chunk
+     * @param opts   options to open the backing device if it's not open yet
      * @return       a pointer to nvchunk object if open success
      * @return       nullptr if failed to open
      */
-    nvchunk* openChunk(string name, const string & path = "", off_t offset = 0, size_t size = 0) 
+    nvchunk* openChunk(string name, const string & path = "", off_t offset = 0, size_t size = 0,
+                       const nv_devopts & opts = nv_devopts()) 
     {
         // check existing chunks with the same name
         // return existing chunk if found
+        // the device stays reachable from its lookup until the chunk
+        // holds it, it's opened again if closed meanwhile
+        nv_ebr::guard g;
         nvchunk *pc = getChunk(name);
         if(pc)
             return pc;
         // the chunk doesn't exist, create a new chunk
-        nv_dev* pDev = openDev(path, size+offset);
-        if(!pDev)
-            return nullptr;
-        pc = mapChunk(name, pDev, offset, size);
-
+        do {
+            nv_dev* pDev = openDev(path, size+offset, opts);
+            if(!pDev)
+                return nullptr;
+            pc = mapChunk(name, pDev, offset, size);
+        } while( !pc && errno == ENODEV );
+        if( !pc && errno == EEXIST ) {
+            // another thread mapped it meanwhile
+            pc = getChunk(name);
+        }
         return pc;
     }
     
-    void unmapChunk(const string & name)
+    /**
+     * @brief copy the byte range of a chunk into a new file, see
+     *        nv_dev::snapshot()
+     * 
+     * @param name     name of the chunk
+     * @param dest     path of the copy, replaced if it exists
+     * @param nthreads number of threads to copy with, 0 for all cpus
+     * @return int 0 if succ, else -1 with errno set
+     *             ENOENT if there's no such chunk
+     */
+    int snapshotChunk(const string & name, const string & dest, unsigned nthreads = 0) {
+        nv_ebr::guard g;
+        nvchunk* pc = getChunk(name);
+        if( !pc ) {
+            errno = ENOENT;
+            return -1;
+        }
+        return pc->dev()->snapshot(dest, pc->offset(), pc->size(), nthreads);
+    }
+
+    /**
+     * @brief open many chunks at once, like openChunk() on each spec
+     *        each device is opened once, however many chunks it backs, 
+     *        and the devices are opened and mapped in parallel
+     *        a new file is created large enough for all its chunks, the
+     *        options of its first spec are used to open it
+     * 
+     * @param specs    the chunks to open
+     * @param nthreads number of threads to open devices with, 0 for all cpus
+     * @return std::vector<nv_chunkresult> the result of each spec, in order
+     */
+    std::vector<nv_chunkresult> openChunks(const std::vector<nv_chunkspec> & specs, 
+                                           unsigned nthreads = 0)
     {
-        for(auto it = mChunks.begin(); it != mChunks.end(); it++) {
-            if((*it)->name() == name) {
-                delete (*it);
-                mChunks.erase(it);
-                break;
+        struct devreq {
+            string      path;
+            size_t      size;
+            nv_devopts  opts;
+            nv_dev*     dev;
+            int         err;
+        };
+        std::vector<nv_chunkresult> results(specs.size(), nv_chunkresult{ nullptr, 0 });
+        std::map<string, size_t>    first;      // by name, first spec to open
+        std::map<string, size_t>    reqidx;     // by path, index in reqs
+        std::vector<devreq>         reqs;       // devices to open
+        std::vector<size_t>         reqof(specs.size(), SIZE_MAX);
+
+        /* one request per device not open yet, memory devices aren't shared */
+        for( size_t i = 0; i < specs.size(); i++ ) {
+            const nv_chunkspec & sp = specs[i];
+            if( mChunks.get(sp.name) || !first.insert({ sp.name, i }).second ) {
+                continue;
+            }
+            nv_ebr::guard g;
+            nv_dev* d = sp.path != "" ? mDevs.get(sp.path) : nullptr;
+            if( d ) {
+                if( d->mode() != sp.opts.mode ) {
+                    results[i].err = EBUSY;
+                }
+                continue;
+            }
+            auto r = sp.path == "" ? reqidx.end() : reqidx.find(sp.path);
+            if( r == reqidx.end() ) {
+                reqof[i] = reqs.size();
+                reqs.push_back({ sp.path, sp.size + sp.offset, sp.opts, nullptr, 0 });
+                if( sp.path != "" ) {
+                    reqidx[sp.path] = reqof[i];
+                }
+            }
+            else {
+                reqof[i] = r->second;
+                reqs[r->second].size = std::max(reqs[r->second].size, sp.size + sp.offset);
+            }
+        }
+
+        nv_parallel_for(reqs.size(), nthreads, [&reqs](size_t b, size_t e) {
+            for( size_t i = b; i < e; i++ ) {
+                errno = 0;
+                reqs[i].dev = nv_dev::open(reqs[i].path, reqs[i].size, false, reqs[i].opts);
+                reqs[i].err = reqs[i].dev ? 0 : (errno ? errno : EINVAL);
+            }
+        });
+        /* the devices stay reachable until their chunks hold them */
+        nv_ebr::guard g;
+        for( auto & r : reqs ) {
+            if( r.dev ) {
+                nv_dev* pd = mDevs.insert(r.dev->name(), r.dev);
+                if( pd != r.dev ) {
+                    // opened by another thread meanwhile
+                    r.dev->close();
+                    delete r.dev;
+                    r.dev = pd;
+                }
+                if( pd->mode() != r.opts.mode ) {
+                    r.dev = nullptr;
+                    r.err = EBUSY;
+                }
             }
         }
+
+        /* map the chunks in order, later specs of a name get the first result */
+        for( size_t i = 0; i < specs.size(); i++ ) {
+            const nv_chunkspec & sp = specs[i];
+            nvchunk* pc = getChunk(sp.name);
+            if( pc ) {
+                results[i].chunk = pc;
+                continue;
+            }
+            auto f = first.find(sp.name);
+            if( f == first.end() ) {
+                // open when planned, unmapped by another thread since
+                results[i].err = ENOENT;
+                continue;
+            }
+            if( f->second != i ) {
+                results[i] = results[f->second];
+                continue;
+            }
+            if( results[i].err ) {
+                continue;
+            }
+            nv_dev* pd = reqof[i] != SIZE_MAX ? reqs[reqof[i]].dev : mDevs.get(sp.path);
+            if( !pd ) {
+                // failed to open, or open when planned and closed since
+                results[i].err = reqof[i] != SIZE_MAX ? reqs[reqof[i]].err : ENOENT;
+                continue;
+            }
+            errno = 0;
+            results[i].chunk = mapChunk(sp.name, pd, sp.offset, sp.size);
+            if( !results[i].chunk && errno == ENODEV ) {
+                // closed by another thread since, open it again
+                results[i].chunk = openChunk(sp.name, sp.path, sp.offset, sp.size, sp.opts);
+            }
+            results[i].err   = results[i].chunk ? 0 : (errno ? errno : EINVAL);
+            if( !results[i].chunk && errno == EEXIST ) {
+                results[i].chunk = getChunk(sp.name);
+                results[i].err   = results[i].chunk ? 0 : EEXIST;
+            }
+        }
+        return results;
+    }
+
+    /**
+     * @brief unmap a chunk, it is freed once no thread still looking 
+     *        it up can hold it
+     * 
+     * @param name name of the chunk
+     */
+    void unmapChunk(const string & name)
+    {
+        nvchunk* pc = mChunks.remove(name);
+        if( pc ) {
+            nv_addrindex::instance().remove(pc, pc->dev(), pc->offset());
+            nv_ebr::instance().retire([pc]() { delete pc; });
+        }
     }
 
+    /**
+     * @brief unmap the chunk starting at va
+     */
     void unmapChunk( void * va )
     {
-        for(auto it = mChunks.begin(); it != mChunks.end(); it++) {
-            if((*it)->va() == va) {
-                delete (*it);
-                mChunks.erase(it);
-                break;
-            }
+        nv_ebr::guard g;
+        nv_resolved r = resolve(va);
+        if( r.chunk && r.offset == 0 ) {
+            unmapChunk(r.chunk->name());
         }
     }
 
+    /**
+     * @brief find the chunk containing an address, e.g. to flush it or
+     *        to turn it into an offset that persists across mappings
+     *        of overlapping chunks, the one starting last before the 
+     *        address is found, chunks of unmapped lazy devices contain
+     *        no address
+     *        the chunk may be unmapped by another thread meanwhile, 
+     *        resolve inside an nv_ebr::guard to keep using it
+     * 
+     * @param addr the address
+     * @return nv_resolved the chunk and the offset of addr within it,
+     *                     a nullptr chunk if no chunk contains addr
+     */
+    nv_resolved resolve(const void* addr) {
+        return nv_addrindex::instance().find(addr);
+    }
+
     size_t nchunks() {
         return mChunks.size();
     }
@@ -525,18 +4589,38 @@ public:
 
     /**
      * @brief close all nv_devs in mDevs and unmap all chunks in mChunks
+     *        returns once they are freed, except devices still 
+     *        referenced elsewhere, must not be called in an nv_ebr::guard
      * 
      */
     void clear() {
-        for( auto pc : mChunks ) {
+        std::vector<nvchunk*> chunks;
+        std::vector<nv_dev*>  devs;
+        mChunks.for_each([&chunks](const string &, nvchunk* pc) {
+            chunks.push_back(pc);
+            return true;
+        });
+        mDevs.for_each([&devs](const string &, nv_dev* pd) {
+            devs.push_back(pd);
+            return true;
+        });
+        for( auto pc : chunks ) {
+            mChunks.remove(pc->name());
+            nv_addrindex::instance().remove(pc, pc->dev(), pc->offset());
+        }
+        for( auto pd : devs ) {
+            mDevs.remove(pd->name());
+        }
+        // wait for readers, and for chunks unmapped earlier to be freed
+        nv_ebr::instance().synchronize();
+        for( auto pc : chunks ) {
             delete pc;
         }
-        for( auto pd: mDevs ) {
-            pd->close();
-            delete pd;
+        for( auto pd: devs ) {
+            pd->put();
         }
-        mChunks.clear();
-        mDevs.clear();
+        // close the devices no chunk holds any more
+        nv_ebr::instance().synchronize();
     }
 };
 
@@ -547,27 +4631,35 @@ public:
  * @param name name of this chunk
  * @param path path of the nvm backing file
  * @param size length in bytes
+ * @param opts options of the new device
  * 
  * @return a pointer to an nv_dev object, nullptr if fail to open
  */
-inline nv_dev* nv_dev::open(const string & name, size_t size, bool create)
+inline nv_dev* nv_dev::open(const string & name, size_t size, bool create,
+                            const nv_devopts & opts)
 {
     nv_dev* pDev;
+    struct stat st;
     
     try {
-        if ( name == "" ) {
-            pDev = new nv_memdev(size);
+        if ( name == "" && opts.shared ) {
+            pDev = new nv_memfddev(size, opts);
+        }
+        else if ( name == "" ) {
+            pDev = new nv_memdev(size, opts);
+        }
+        else if ( stat(name.c_str(), &st) == 0 && S_ISCHR(st.st_mode) ) {
+            /* devdax device (nvdimm or optane) */
+            pDev = new nv_devdaxdev(name, size, opts);
         }
         else {
             /*
-             * file exists, choose the corresponding object type
              * nv_filedev is for general usage
              * there could be optimal implementation for specific file types
-             *   S_ISCHR(st_buf.st_mode) devdax device (nvdimm or optane)
              *   S_ISBLK(st_buf.st_mode) block device (nvme ssd)
              *   S_ISREG(st_buf.st_mode) file on a fsdax file system or a regular file system
              */
-            pDev = new nv_filedev(name, size, create);
+            pDev = new nv_filedev(name, size, create, opts);
         }
     }
     catch (nv_exception & e) {
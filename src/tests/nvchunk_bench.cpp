@@ -0,0 +1,524 @@
+#include "nvchunk.hpp"
+
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch.hpp"
+
+using namespace std;
+using namespace NVCHUNK;
+
+#ifdef HAVE_LIBPMEM_H
+static const std::string str_bench_dir = "/pmem/";
+#else
+static const std::string str_bench_dir = "/tmp/";
+#endif
+
+TEST_CASE("flushBench", "[flush]") {
+    const size_t nrecs  = 1024;         // records per batch
+    const size_t stride = 256;          // records are 64 bytes, 256 bytes apart
+    string path = str_bench_dir + "bench_flush";
+
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    char* base = (char*)dev->va() + 40;
+
+    auto update = [&](uint64_t v) {
+        for (size_t i = 0; i < nrecs; i++) {
+            memset(base + i * stride, (int)v, 64);
+        }
+    };
+
+    /* what nvchunk::flush did before: one sync per record (page aligned 
+     * by hand, unaligned addresses are refused by msync) */
+    BENCHMARK("per record sync") {
+        update(1);
+        for (size_t i = 0; i < nrecs; i++) {
+            char* rec = base + i * stride;
+            if (dev->is_pmem()) {
+                pmem_persist(rec, 64);
+            } else {
+                char* pg = (char*)((uintptr_t)rec & ~(nv_pagesize() - 1));
+                pmem_msync(pg, rec + 64 - pg);
+            }
+        }
+    };
+
+    BENCHMARK("per record nv_dev::flush") {
+        update(2);
+        for (size_t i = 0; i < nrecs; i++) {
+            dev->flush(base + i * stride, 64);
+        }
+    };
+
+    BENCHMARK("batched nv_dev::flushv") {
+        update(3);
+        std::vector<nv_range> batch(nrecs);
+        for (size_t i = 0; i < nrecs; i++) {
+            batch[i].addr = base + i * stride;
+            batch[i].size = 64;
+        }
+        return dev->flushv(batch);
+    };
+
+    delete dev;
+    unlink(path.c_str());
+}
+
+TEST_CASE("zeroBench", "[zero]") {
+    const size_t size = MB * 256;
+    string path = str_bench_dir + "bench_zero";
+
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, size);
+    REQUIRE(dev != nullptr);
+    nvchunk pc("bench_zero", dev);
+    memset(dev->va(), 1, size);
+
+    /* bandwidth is size / mean */
+    BENCHMARK("file memset, 1 thread") {
+        return pc.zero(NV_ZERO_MEMSET);
+    };
+    BENCHMARK("file non-temporal, all cpus") {
+        return pc.zero(NV_ZERO_NT);
+    };
+    BENCHMARK("file fallocate") {
+        return pc.zero(NV_ZERO_FALLOCATE);
+    };
+    dev->put();
+    unlink(path.c_str());
+
+    dev = nv_dev::open("", size);
+    REQUIRE(dev != nullptr);
+    memset(dev->va(), 1, size);
+    BENCHMARK("memory memset, 1 thread") {
+        return dev->zero(dev->va(), size, NV_ZERO_MEMSET);
+    };
+    BENCHMARK("memory non-temporal, all cpus") {
+        return dev->zero(dev->va(), size, NV_ZERO_NT);
+    };
+    delete dev;
+}
+
+TEST_CASE("drainBench", "[drain]") {
+    const size_t nrecs = 256;           // records per transaction
+    const size_t ndevs = 4;
+    std::vector<nvchunk*> chunks;
+
+    NVM::instance().clear();
+    for (size_t d = 0; d < ndevs; d++) {
+        string path = str_bench_dir + "bench_drain" + std::to_string(d);
+        unlink(path.c_str());
+        chunks.push_back(NVM::instance().openChunk("bench_drain" + std::to_string(d), path, 0, MB));
+        REQUIRE(chunks.back() != nullptr);
+    }
+
+    auto record = [&](size_t i) -> uint64_t* {
+        return (uint64_t*)chunks[i % ndevs]->va() + (i / ndevs) * 8;
+    };
+    auto syncs = [&]() {
+        uint64_t n = 0;
+        for (auto pc : chunks) n += pc->dev()->nsyncs();
+        return n;
+    };
+    auto per_record = [&]() {
+        for (size_t i = 0; i < nrecs; i++) {
+            *record(i) = i;
+            chunks[i % ndevs]->flush(record(i), sizeof(uint64_t));
+        }
+    };
+    auto nodrain = [&]() {
+        for (size_t i = 0; i < nrecs; i++) {
+            *record(i) = i;
+            chunks[i % ndevs]->flush_nodrain(record(i), sizeof(uint64_t));
+        }
+        for (auto pc : chunks) pc->drain();
+    };
+    auto batched = [&]() {
+        nv_persistbatch batch;
+        for (size_t i = 0; i < nrecs; i++) {
+            *record(i) = i;
+            batch.add(chunks[i % ndevs], record(i), sizeof(uint64_t));
+        }
+        return batch.commit();
+    };
+
+    /* drains (or msyncs) per record */
+    uint64_t s0 = syncs(); per_record();
+    uint64_t s1 = syncs(); nodrain();
+    uint64_t s2 = syncs(); batched();
+    uint64_t s3 = syncs();
+    std::cout << "syncs per record: per record flush " << (double)(s1 - s0) / nrecs
+              << ", flush_nodrain+drain " << (double)(s2 - s1) / nrecs
+              << ", nv_persistbatch "     << (double)(s3 - s2) / nrecs << std::endl;
+
+    BENCHMARK("per record flush") {
+        per_record();
+    };
+    BENCHMARK("flush_nodrain + drain") {
+        nodrain();
+    };
+    BENCHMARK("nv_persistbatch") {
+        return batched();
+    };
+
+    NVM::instance().clear();
+    for (size_t d = 0; d < ndevs; d++) {
+        unlink((str_bench_dir + "bench_drain" + std::to_string(d)).c_str());
+    }
+}
+
+TEST_CASE("groupCommitBench", "[groupcommit]") {
+    const size_t nthreads = 8, ncommits = 64;
+    string path = str_bench_dir + "bench_group";
+
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    uint64_t* recs = (uint64_t*)dev->va();
+
+    /* nthreads * ncommits transactions of one record each */
+    auto run = [&](bool group) {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nthreads; t++) {
+            threads.emplace_back([&, t] {
+                for (size_t i = 0; i < ncommits; i++) {
+                    uint64_t* r = recs + (i * nthreads + t) * 64;
+                    *r = i;
+                    group ? dev->group_flush(r, sizeof(*r)) : dev->flush(r, sizeof(*r));
+                }
+            });
+        }
+        for (auto & t : threads) {
+            t.join();
+        }
+    };
+
+    BENCHMARK("independent flush") {
+        run(false);
+    };
+    BENCHMARK("group commit, 100us window") {
+        run(true);
+    };
+    dev->set_group_commit(std::chrono::microseconds(1000), 64 * KB);
+    BENCHMARK("group commit, 1ms window") {
+        run(true);
+    };
+
+    delete dev;
+    unlink(path.c_str());
+}
+
+TEST_CASE("snapshotBench", "[snapshot]") {
+    const size_t size = MB * 256;
+    string path = str_bench_dir + "bench_snap";
+    string snap = str_bench_dir + "bench_snap.bak";
+
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, size);
+    REQUIRE(dev != nullptr);
+    memset(dev->va(), 1, size);
+    REQUIRE(0 == dev->flush());
+
+    BENCHMARK("snapshot, 1 thread") {
+        return dev->snapshot(snap, 0, 0, 1);
+    };
+    BENCHMARK("snapshot, all cpus") {
+        return dev->snapshot(snap);
+    };
+    BENCHMARK("snapshot of a 1MB range") {
+        return dev->snapshot(snap, MB * 100, MB);
+    };
+
+    delete dev;
+    unlink(path.c_str());
+    unlink(snap.c_str());
+}
+
+TEST_CASE("allocBench", "[alloc]") {
+    const size_t size = MB * 64;
+    string path = str_bench_dir + "bench_alloc";
+    size_t pg = nv_pagesize();
+
+    /* first write to every page, i.e. the page fault path
+       each run writes a fresh device, so every write faults */
+    auto bench = [&](nv_alloc alloc, Catch::Benchmark::Chronometer meter) {
+        nv_devopts opts;
+        opts.alloc = alloc;
+        std::vector<nv_dev*> devs(meter.runs());
+        for (size_t r = 0; r < devs.size(); r++) {
+            string rp = path + std::to_string(r);
+            unlink(rp.c_str());
+            devs[r] = nv_dev::open(rp, size, false, opts);
+            REQUIRE(devs[r] != nullptr);
+        }
+        meter.measure([&](int r) {
+            char* p = (char*)devs[r]->va();
+            for (size_t off = 0; off < size; off += pg) {
+                p[off] = 1;
+            }
+        });
+        for (size_t r = 0; r < devs.size(); r++) {
+            delete devs[r];
+            unlink((path + std::to_string(r)).c_str());
+        }
+    };
+
+    std::cout << "faults per run: " << size / pg << std::endl;
+    BENCHMARK_ADVANCED("first write, sparse")(Catch::Benchmark::Chronometer meter) {
+        bench(NV_ALLOC_SPARSE, meter);
+    };
+    BENCHMARK_ADVANCED("first write, fallocate")(Catch::Benchmark::Chronometer meter) {
+        bench(NV_ALLOC_FALLOCATE, meter);
+    };
+}
+
+TEST_CASE("lazyStartupBench", "[lazy]") {
+    const int ndevs = 10000;
+    string dir = str_bench_dir + "bench_lazy/";
+    mkdir(dir.c_str(), 0777);
+    std::vector<string> paths;
+    for (int i = 0; i < ndevs; i++) {
+        paths.push_back(dir + std::to_string(i));
+        nv_dev* dev = nv_dev::open(paths[i], 64 * KB);
+        REQUIRE(dev != nullptr);
+        delete dev;
+    }
+
+    /* open all devices, as a service registering its tenants at startup */
+    auto startup = [&](bool lazy, Catch::Benchmark::Chronometer meter) {
+        nv_devopts opts;
+        opts.lazy = lazy;
+        std::vector<std::vector<nv_dev*>> devs(meter.runs());
+        meter.measure([&](int r) {
+            for (int i = 0; i < ndevs; i++) {
+                devs[r].push_back(nv_dev::open(paths[i], 0, false, opts));
+            }
+        });
+        for (auto & v : devs) {
+            for (auto d : v) {
+                delete d;
+            }
+        }
+    };
+
+    BENCHMARK_ADVANCED("open 10k devices")(Catch::Benchmark::Chronometer meter) {
+        startup(false, meter);
+    };
+    BENCHMARK_ADVANCED("open 10k lazy devices")(Catch::Benchmark::Chronometer meter) {
+        startup(true, meter);
+    };
+
+    /* touch a working set of 1000 of them under a budget of 256 mappings */
+    nv_devopts opts;
+    opts.lazy = true;
+    std::vector<nv_dev*> devs;
+    for (int i = 0; i < ndevs; i++) {
+        devs.push_back(nv_dev::open(paths[i], 0, false, opts));
+    }
+    nv_lazymap::instance().set_budget(256);
+    std::mt19937 rng(1);
+    BENCHMARK("va() of 1000 random lazy devices, budget 256") {
+        uint64_t sum = 0;
+        for (int i = 0; i < 1000; i++) {
+            sum += *(char*)devs[rng() % 1000]->va();
+        }
+        return sum;
+    };
+    std::cout << "lazy devices mapped: " << nv_lazymap::instance().nmapped()
+              << ", unmapped by the budget: " << nv_lazymap::instance().nevictions() << std::endl;
+    nv_lazymap::instance().set_budget(0);
+
+    for (auto d : devs) {
+        delete d;
+    }
+    for (auto & p : paths) {
+        unlink(p.c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("openChunksBench", "[openchunks]") {
+    const int nfiles = 128, nper = 4;
+    string dir = str_bench_dir + "bench_bulk/";
+    mkdir(dir.c_str(), 0777);
+
+    std::vector<nv_chunkspec> specs;
+    for (int f = 0; f < nfiles; f++) {
+        string path = dir + std::to_string(f);
+        nv_dev* dev = nv_dev::open(path, nper * MB);
+        REQUIRE(dev != nullptr);
+        delete dev;
+        for (int c = 0; c < nper; c++) {
+            specs.push_back(nv_chunkspec(std::to_string(f) + "_" + std::to_string(c), 
+                                         path, c * MB, MB));
+        }
+    }
+
+    /* boot: open every chunk, prefaulted as a service would before serving */
+    for (auto & sp : specs) {
+        sp.opts.prefault = NV_PREFAULT_POPULATE;
+        sp.opts.prefault_threads = 1;
+    }
+    NVM::instance().clear();
+    BENCHMARK("openChunk, one by one") {
+        for (auto & sp : specs) {
+            NVM::instance().openChunk(sp.name, sp.path, sp.offset, sp.size, sp.opts);
+        }
+        NVM::instance().clear();
+    };
+    BENCHMARK("openChunks, all cpus") {
+        NVM::instance().openChunks(specs);
+        NVM::instance().clear();
+    };
+
+    for (int f = 0; f < nfiles; f++) {
+        unlink((dir + std::to_string(f)).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("registryBench", "[registry]") {
+    const size_t nchunks = 100000, nlookups = 1 << 20;
+    unsigned nthreads = std::max(4u, std::thread::hardware_concurrency());
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    nv_dev* dev = nvm.openDev("", nchunks * 64);
+    REQUIRE(dev != nullptr);
+    std::vector<string> names(nchunks);
+    for (size_t i = 0; i < nchunks; i++) {
+        names[i] = "chunk_" + std::to_string(i);
+        REQUIRE(nvm.mapChunk(names[i], dev, i * 64, 64) != nullptr);
+    }
+
+    /* each thread resolves its share of nlookups random names */
+    auto lookups = [&](unsigned nth) {
+        std::atomic<size_t> found(0);
+        std::vector<std::thread> ths;
+        for (unsigned t = 0; t < nth; t++) {
+            ths.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                size_t n = 0;
+                for (size_t i = 0; i < nlookups / nth; i++) {
+                    n += NVM::instance().getChunk(names[rng() % nchunks]) != nullptr;
+                }
+                found += n;
+            });
+        }
+        for (auto & th : ths) {
+            th.join();
+        }
+        return found.load();
+    };
+
+    BENCHMARK("1M lookups of 100k chunks, 1 thread") {
+        return lookups(1);
+    };
+    BENCHMARK("1M lookups of 100k chunks, " + std::to_string(nthreads) + " threads") {
+        return lookups(nthreads);
+    };
+    BENCHMARK_ADVANCED("1M lookups of 100k chunks, " + std::to_string(nthreads) + 
+                       " threads, chunks mapped and unmapped meanwhile")(Catch::Benchmark::Chronometer meter) {
+        std::atomic<bool> stop(false);
+        std::thread writer([&]() {
+            for (size_t i = 0; !stop; i = (i + 1) % 1000) {
+                string name = "churn_" + std::to_string(i);
+                NVM::instance().mapChunk(name, dev, 0, 64);
+                NVM::instance().unmapChunk(name);
+            }
+        });
+        meter.measure([&] { return lookups(nthreads); });
+        stop = true;
+        writer.join();
+    };
+
+    nvm.clear();
+}
+
+TEST_CASE("resolveBench", "[resolve]") {
+    const size_t ndevs = 100, nper = 1000, nlookups = 1 << 20;
+    unsigned nthreads = std::max(4u, std::thread::hardware_concurrency());
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    /* 100k chunks over 100 devices */
+    std::vector<char*> bases;
+    for (size_t d = 0; d < ndevs; d++) {
+        nv_dev* dev = nvm.openDev("", nper * 4096);
+        REQUIRE(dev != nullptr);
+        bases.push_back((char*)dev->va());
+        for (size_t c = 0; c < nper; c++) {
+            REQUIRE(nvm.mapChunk(std::to_string(d) + "_" + std::to_string(c), dev, 
+                                 c * 4096, 4096) != nullptr);
+        }
+    }
+
+    auto resolves = [&](unsigned nth) {
+        std::atomic<size_t> found(0);
+        std::vector<std::thread> ths;
+        for (unsigned t = 0; t < nth; t++) {
+            ths.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                size_t n = 0;
+                for (size_t i = 0; i < nlookups / nth; i++) {
+                    char* p = bases[rng() % ndevs] + rng() % (nper * 4096);
+                    n += NVM::instance().resolve(p).chunk != nullptr;
+                }
+                found += n;
+            });
+        }
+        for (auto & th : ths) {
+            th.join();
+        }
+        return found.load();
+    };
+
+    BENCHMARK("1M resolves over 100k chunks, 1 thread") {
+        return resolves(1);
+    };
+    BENCHMARK("1M resolves over 100k chunks, " + std::to_string(nthreads) + " threads") {
+        return resolves(nthreads);
+    };
+
+    nvm.clear();
+}
+
+TEST_CASE("refcountBench", "[refcount]") {
+    const int ndevs = 1000;
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    /* each run unmaps and closes its own 1000 touched 64KB devices */
+    auto bench = [&](bool reclaim, Catch::Benchmark::Chronometer meter) {
+        std::vector<std::vector<string>> devs(meter.runs());
+        for (size_t r = 0; r < devs.size(); r++) {
+            for (int i = 0; i < ndevs; i++) {
+                nvchunk* pc = nvm.openChunk("rc_" + std::to_string(r) + "_" + std::to_string(i), 
+                                            "", 0, 64 * KB);
+                REQUIRE(pc != nullptr);
+                memset(pc->va(), 1, 64 * KB);
+                devs[r].push_back(pc->dev()->name());
+            }
+        }
+        meter.measure([&](int r) {
+            for (int i = 0; i < ndevs; i++) {
+                nvm.unmapChunk("rc_" + std::to_string(r) + "_" + std::to_string(i));
+                nvm.closeDev(devs[r][i]);
+            }
+            if (reclaim) {
+                nv_ebr::instance().synchronize();
+                nv_ebr::instance().synchronize();
+            }
+        });
+        nvm.clear();
+    };
+
+    /* the caller only drops references, munmap runs on the reclaimer */
+    BENCHMARK_ADVANCED("unmap and close 1000 touched 64KB devices, caller")(Catch::Benchmark::Chronometer meter) {
+        bench(false, meter);
+    };
+    BENCHMARK_ADVANCED("unmap and close 1000 touched 64KB devices, until unmapped")(Catch::Benchmark::Chronometer meter) {
+        bench(true, meter);
+    };
+}
@@ -2,6 +2,8 @@
 
 #include "nvchunk.hpp"
 #include <fstream>
+#include <sys/wait.h>
+#include <dirent.h>
 #include <sstream>
 #include "flog.hpp"
 
@@ -286,3 +288,1746 @@ TEST_CASE("nvchunkTest6", "[NVM]") {
     REQUIRE(NVM::instance().mDevs.size() == count-1);
     REQUIRE(NVM::instance().mDevs.size() == 0);
 }
+
+/* AnonHugePages of the mapping holding addr in /proc/self/smaps, in kB */
+static size_t anon_huge_kb(void* addr) {
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool found = false;
+    while (getline(smaps, line)) {
+        uintptr_t b, e;
+        size_t kb;
+        if (sscanf(line.c_str(), "%lx-%lx ", &b, &e) == 2 && line.find(':') > line.find(' ')) {
+            found = b <= (uintptr_t)addr && (uintptr_t)addr < e;
+        }
+        else if (found && sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1) {
+            return kb;
+        }
+    }
+    return 0;
+}
+
+TEST_CASE("nvchunkTest7", "[hugepage]") {
+    size_t base = ::sysconf(_SC_PAGESIZE);
+
+    /* default policy always maps base pages */
+    nv_dev* dev = new nv_memdev(MB * 4);
+    REQUIRE(dev->hugepage() == NV_HUGEPAGE_NONE);
+    REQUIRE(dev->pagesize() == base);
+    delete dev;
+
+    /* explicit hugetlb falls back gracefully if no hugepage is reserved */
+    nv_devopts opts;
+    opts.hugepage = NV_HUGEPAGE_2M;
+    dev = nv_dev::open("", MB * 5, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->size() == MB * 5);
+    if (dev->hugepage() == NV_HUGEPAGE_NONE) {
+        REQUIRE(dev->pagesize() == base);
+    }
+    else {
+        REQUIRE(dev->pagesize() >= MB * 2);
+        REQUIRE(((uintptr_t)dev->va() & (dev->pagesize() - 1)) == 0);
+    }
+    memset(dev->va(), 0xa5, dev->size());
+    REQUIRE(((unsigned char*)dev->va())[dev->size() - 1] == 0xa5);
+    delete dev;
+
+    /* transparent hugepages are only reported once the kernel backs the 
+       mapping with them */
+    opts.hugepage = NV_HUGEPAGE_THP;
+    opts.prefault = NV_PREFAULT_TOUCH;
+    dev = nv_dev::open("", MB * 5, false, opts);
+    REQUIRE(dev != nullptr);
+    if (dev->hugepage() == NV_HUGEPAGE_THP) {
+        REQUIRE(dev->pagesize() >= MB * 2);
+        REQUIRE(((uintptr_t)dev->va() & (dev->pagesize() - 1)) == 0);
+        REQUIRE(anon_huge_kb(dev->va()) * KB >= dev->pagesize());
+    }
+    else {
+        REQUIRE(dev->hugepage() == NV_HUGEPAGE_NONE);
+        REQUIRE(dev->pagesize() == base);
+    }
+    REQUIRE(((unsigned char*)dev->va())[dev->size() - 1] == 0);
+    delete dev;
+    opts.prefault = NV_PREFAULT_NONE;
+
+    /* hugepage policy selected through NVM */
+    NVM::instance().clear();
+    opts.hugepage = NV_HUGEPAGE_THP;
+    nvchunk* pc = NVM::instance().openChunk("chunk_huge", "", 0, MB * 4, opts);
+    REQUIRE(pc != nullptr);
+    REQUIRE(pc->_pDev->hugepage() != NV_HUGEPAGE_2M);
+    REQUIRE(pc->_pDev->hugepage() != NV_HUGEPAGE_1G);
+    NVM::instance().clear();
+}
+
+TEST_CASE("nvchunkTest8", "[numa]") {
+    /* node 0 exists on every machine */
+    nv_devopts opts;
+    opts.numa_node = 0;
+    nv_dev* dev = nv_dev::open("", MB * 4, false, opts);
+    REQUIRE(dev != nullptr);
+    memset(dev->va(), 1, dev->size());
+    if (dev->numa_mask()) {
+        REQUIRE(dev->numa_mask() == 1);
+        REQUIRE(dev->numa_node() == 0);
+    }
+    delete dev;
+
+    /* nodes that aren't online leave the mapping unbound */
+    opts.numa_node = 63;
+    if (!(nv_numa_online() & (1ull << 63))) {
+        dev = nv_dev::open("", MB * 4, false, opts);
+        REQUIRE(dev != nullptr);
+        REQUIRE(dev->numa_mask() == 0);
+        delete dev;
+    }
+
+    /* interleave over all online nodes */
+    opts.numa_node = -1;
+    opts.numa_interleave = nv_numa_online();
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_numa", "/tmp/dev_numa", 0, MB * 2, opts);
+    REQUIRE(pc != nullptr);
+    /* the page cache of a file device is placed by prefault, not bound */
+    REQUIRE(pc->_pDev->numa_mask() == 0);
+    memset(pc->va(), 1, pc->size());
+    REQUIRE(pc->numa_node() >= -1);
+    if (nv_numa_online() == 1 && pc->numa_node() >= 0) {
+        REQUIRE(pc->numa_node() == 0);
+    }
+    NVM::instance().clear();
+    unlink("/tmp/dev_numa");
+}
+
+TEST_CASE("nvchunkTest9", "[prefault]") {
+    string path = "/tmp/dev_prefault";
+    unlink(path.c_str());
+
+    /* no prefault by default */
+    nv_dev* dev = nv_dev::open(path, MB * 8);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->prefault_time().count() == 0);
+    ((char*)dev->va())[MB] = 'P';
+    dev->flush();
+    delete dev;
+
+    /* reopen with prefault, data stays intact */
+    nv_devopts opts;
+    opts.prefault = NV_PREFAULT_POPULATE;
+    opts.prefault_threads = 4;
+    dev = nv_dev::open(path, 0, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->prefault_time().count() > 0);
+    REQUIRE(((char*)dev->va())[MB] == 'P');
+
+    REQUIRE(0 == dev->prefault(NV_PREFAULT_TOUCH, 3));
+    REQUIRE(((char*)dev->va())[MB] == 'P');
+    delete dev;
+    unlink(path.c_str());
+
+    /* memory based device is faulted in writable */
+    opts.prefault = NV_PREFAULT_TOUCH;
+    opts.prefault_threads = 0;
+    dev = nv_dev::open("", MB * 8 + 100, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->prefault_time().count() > 0);
+    REQUIRE(((char*)dev->va())[MB * 8 + 99] == 0);
+    delete dev;
+}
+
+TEST_CASE("nvchunkTest10", "[nv_devdaxdev]") {
+    /* a regular file and a fake sysfs stand in for a devdax device */
+    string path  = "/tmp/dax_standin";
+    string sysfs = "/tmp/nvchunk_sysfs";
+    string attr  = sysfs + "/dev/char/0:0";
+    REQUIRE(0 == system(("mkdir -p " + attr + "/device").c_str()));
+    ofstream(attr + "/size") << MB * 8 << endl;
+    ofstream(attr + "/device/align") << MB * 2 << endl;
+    unlink(path.c_str());
+    { ofstream f(path); }
+    REQUIRE(0 == truncate(path.c_str(), MB * 8));
+
+    nv_dev* dev = new nv_devdaxdev(path, 0, nv_devopts(), sysfs);
+    REQUIRE(dev->size() == MB * 8);
+    REQUIRE(dev->align() == MB * 2);
+    REQUIRE(((uintptr_t)dev->va() & (MB * 2 - 1)) == 0);
+    strcpy((char*)dev->va() + MB * 2, "devdax");
+    REQUIRE(0 == dev->flush());
+
+    /* chunk offsets must respect the device alignment */
+    REQUIRE_THROWS_AS(nvchunk("dax_bad", dev, 4096, MB), nv_exception);
+    REQUIRE(nullptr == NVM::instance().mapChunk("dax_bad", dev, 4096, MB));
+    nvchunk* pc = NVM::instance().mapChunk("dax_chunk", dev, MB * 2, MB * 2);
+    REQUIRE(pc != nullptr);
+    REQUIRE(string((char*)pc->va()) == "devdax");
+    NVM::instance().unmapChunk("dax_chunk");
+    dev->put();
+
+    /* size can't exceed the device */
+    REQUIRE_THROWS_AS(nv_devdaxdev(path, MB * 9, nv_devopts(), sysfs), nv_exception);
+
+    /* partial mapping */
+    dev = new nv_devdaxdev(path, MB * 3, nv_devopts(), sysfs);
+    REQUIRE(dev->size() == MB * 3);
+    REQUIRE(string((char*)dev->va() + MB * 2) == "devdax");
+    delete dev;
+
+    /* missing sysfs attributes */
+    REQUIRE_THROWS_AS(nv_devdaxdev(path, 0, nv_devopts(), "/tmp/nvchunk_nosysfs"), nv_exception);
+
+    unlink(path.c_str());
+    REQUIRE(0 == system(("rm -rf " + sysfs).c_str()));
+}
+
+#ifndef HAVE_LIBPMEM_H
+TEST_CASE("nvchunkTest11", "[cpmem]") {
+#if defined(__x86_64__)
+    /* clflush is always there on x86_64 */
+    REQUIRE(cpmem_flush_type() != CPMEM_FLUSH_NONE);
+#endif
+
+    /* only MAP_SYNC ranges are treated as pmem */
+    char* buf = (char*) ::mmap(NULL, MB, PROT_READ|PROT_WRITE, 
+                               MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    REQUIRE(buf != MAP_FAILED);
+    REQUIRE(0 == pmem_is_pmem(buf, MB));
+    cpmem_sync_ranges::instance().add(buf, MB);
+    REQUIRE((cpmem_flush_type() != CPMEM_FLUSH_NONE) == (bool)pmem_is_pmem(buf + 100, 4096));
+    REQUIRE(0 == pmem_is_pmem(buf + 100, MB));
+    strcpy(buf + 100, "persisted with cache flushes");
+    pmem_persist(buf + 100, 64);
+    REQUIRE(string(buf + 100) == "persisted with cache flushes");
+    cpmem_sync_ranges::instance().remove(buf);
+    REQUIRE(0 == pmem_is_pmem(buf, MB));
+    ::munmap(buf, MB);
+
+    /* a regular file system refuses MAP_SYNC, the mapping falls back to msync */
+    string path = "/tmp/dev_mapsync";
+    size_t len  = 0;
+    int    pmem = -1;
+    void*  p = pmem_map_file(path.c_str(), MB, PMEM_FILE_CREATE, 0666, &len, &pmem);
+    REQUIRE(p != nullptr);
+    REQUIRE(len == MB);
+    REQUIRE(pmem == pmem_is_pmem(p, len));
+    REQUIRE(0 == pmem_unmap(p, len));
+    REQUIRE(0 == pmem_is_pmem(p, len));
+    unlink(path.c_str());
+}
+#endif
+
+TEST_CASE("nvchunkTest12", "[flush]") {
+    size_t pg = nv_pagesize();
+    char*  base = (char*)(uintptr_t)(pg * 1024);
+
+    /* ranges are rounded out, sorted and merged */
+    std::vector<nv_range> r = {
+        { base + pg * 4 + 10, 20 },         // page 4
+        { base + 1, 1 },                    // page 0
+        { base + pg - 1, 2 },               // page 0-1
+        { base + pg * 4 + 100, pg },        // page 4-5
+        { base + pg * 40, 0 },              // empty
+    };
+    nv_coalesce(r, pg);
+    REQUIRE(r.size() == 2);
+    REQUIRE(r[0].addr == base);
+    REQUIRE(r[0].size == pg * 2);
+    REQUIRE(r[1].addr == base + pg * 4);
+    REQUIRE(r[1].size == pg * 2);
+
+    /* small gaps are bridged */
+    nv_coalesce(r, pg, pg * 2);
+    REQUIRE(r.size() == 1);
+    REQUIRE(r[0].size == pg * 6);
+
+    /* cache line granularity */
+    r = { { base + 70, 10 }, { base + 200, 100 }, { base + 64, 1 } };
+    nv_coalesce(r, NV_CACHELINE);
+    REQUIRE(r.size() == 2);
+    REQUIRE(r[0].addr == base + 64);
+    REQUIRE(r[0].size == 64);
+    REQUIRE(r[1].addr == base + 192);
+    REQUIRE(r[1].size == 128);
+
+    /* unaligned records flush fine, a batch costs one sync per run */
+    string path = "/tmp/dev_flush";
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    nvchunk pc("chunk_flush", dev, 3, MB);
+    auto recs = pc.getmapper<uint64_t>();
+    recs[1] = 0x1234;
+    uint64_t syncs = dev->nsyncs();
+    REQUIRE(0 == dev->flush(&recs[1], sizeof(uint64_t)));
+    REQUIRE(dev->nsyncs() == syncs + 1);
+
+    std::vector<nv_range> batch;
+    for (size_t i = 0; i < 1000; i++) {
+        recs[i * 7] = i;
+        batch.push_back({ &recs[i * 7], sizeof(uint64_t) });
+    }
+    syncs = dev->nsyncs();
+    REQUIRE(0 == dev->flushv(batch));
+    REQUIRE(dev->nsyncs() == syncs + 1);
+    dev->put();
+
+    /* memory based devices can't be flushed */
+    dev = nv_dev::open("", MB);
+    batch = { { dev->va(), 8 } };
+    REQUIRE(-1 == dev->flushv(batch));
+    delete dev;
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest13", "[grow]") {
+    string path = "/tmp/dev_grow";
+    unlink(path.c_str());
+
+    /* devices without reserved address space can't grow */
+    nv_dev* dev = nv_dev::open(path, MB);
+    REQUIRE(dev != nullptr);
+    REQUIRE(-1 == dev->grow(MB * 2));
+    REQUIRE(errno == ENOTSUP);
+    delete dev;
+    unlink(path.c_str());
+
+    nv_devopts opts;
+    opts.reserve = MB * 64;
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_grow", path, 0, MB + 100, opts);
+    REQUIRE(pc != nullptr);
+    nv_dev* pd = pc->_pDev;
+    void*   va = pd->va();
+    strcpy((char*)pc->va() + MB, "before grow");
+
+    /* grow in place, addresses stay valid */
+    REQUIRE(0 == pd->grow(MB * 8));
+    REQUIRE(pd->va() == va);
+    REQUIRE(pd->size() == MB * 8);
+    REQUIRE(string((char*)pc->va() + MB) == "before grow");
+    struct stat st;
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE(st.st_size == MB * 8);
+
+    /* the new tail is usable and persistent */
+    strcpy((char*)va + MB * 8 - 20, "after grow");
+    REQUIRE(0 == pd->flush((char*)va + MB * 8 - 20, 20));
+    nvchunk* pc2 = NVM::instance().mapChunk("chunk_tail", pd, MB * 4, MB * 4);
+    REQUIRE(pc2 != nullptr);
+
+    /* can't shrink, can't grow past the reservation */
+    REQUIRE(-1 == pd->grow(MB));
+    REQUIRE(-1 == pd->grow(MB * 65));
+    REQUIRE(0 == pd->grow(MB * 64));
+    REQUIRE(pd->va() == va);
+
+    NVM::instance().clear();
+    dev = nv_dev::open(path, 0);
+    REQUIRE(dev->size() == MB * 64);
+    REQUIRE(string((char*)dev->va() + MB * 8 - 20) == "after grow");
+    delete dev;
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest14", "[nv_memfddev]") {
+    nv_devopts opts;
+    opts.shared = true;
+    opts.seal   = true;
+
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_shared", "", 0, MB * 4, opts);
+    REQUIRE(pc != nullptr);
+    nv_memfddev* pd = dynamic_cast<nv_memfddev*>(pc->_pDev);
+    REQUIRE(pd != nullptr);
+    REQUIRE(pd->fd() >= 0);
+    REQUIRE(-1 == pd->flush(nullptr, 0));
+    strcpy((char*)pc->va(), "from parent");
+
+    /* sealed memfd can't be resized */
+    REQUIRE(-1 == ftruncate(pd->fd(), MB));
+
+    /* a child adopts the fd and maps the same memory */
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        nv_dev* child = NVM::instance().adoptDev(dup(pd->fd()), "adopted");
+        bool ok = child && child->size() == MB * 4 && 
+                  child->va() != pc->va() &&
+                  string((char*)child->va()) == "from parent";
+        if (ok) {
+            strcpy((char*)child->va() + MB, "from child");
+        }
+        _exit(ok ? 0 : 1);
+    }
+    int status = -1;
+    REQUIRE(pid == waitpid(pid, &status, 0));
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+    REQUIRE(string((char*)pc->va() + MB) == "from child");
+
+    /* adopting in the same process shares the memory too */
+    nv_dev* pd2 = NVM::instance().adoptDev(dup(pd->fd()));
+    REQUIRE(pd2 != nullptr);
+    REQUIRE(pd2->name() != pd->name());
+    ((char*)pd2->va())[10] = 'X';
+    REQUIRE(((char*)pc->va())[10] == 'X');
+    REQUIRE(nullptr == NVM::instance().adoptDev(-1));
+    REQUIRE(errno == EBADF);
+    NVM::instance().clear();
+
+    /* hugetlb memfd falls back if no hugepage is reserved */
+    opts.hugepage = NV_HUGEPAGE_2M;
+    nv_dev* dev = nv_dev::open("", MB * 3, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->size() == MB * 3);
+    memset(dev->va(), 1, dev->size());
+    delete dev;
+}
+
+TEST_CASE("nvchunkTest15", "[zero]") {
+    string path = "/tmp/dev_zero";
+    unlink(path.c_str());
+
+    nv_zero modes[] = { NV_ZERO_AUTO, NV_ZERO_MEMSET, NV_ZERO_NT, NV_ZERO_FALLOCATE };
+    for (nv_zero how : modes) {
+        nv_dev* dev = nv_dev::open(path, MB * 16 + 7);
+        REQUIRE(dev != nullptr);
+        char* p = (char*)dev->va();
+
+        /* a chunk zeroes its own range only */
+        nvchunk pc("chunk_zero", dev, 13, MB * 16 - 20);
+        memset(p, 0x5a, dev->size());
+        REQUIRE(0 == pc.zero(how, 3));
+        REQUIRE(p[12] == 0x5a);
+        REQUIRE(p[13] == 0);
+        REQUIRE(p[MB * 8] == 0);
+        REQUIRE(p[MB * 16 - 8] == 0);
+        REQUIRE(p[MB * 16 - 7] == 0x5a);
+        REQUIRE(std::count(p + 13, p + MB * 16 - 7, 0) == MB * 16 - 20);
+
+        /* tiny unaligned ranges */
+        REQUIRE(0 == dev->zero(p + 3, 5, how));
+        REQUIRE(p[2] == 0x5a);
+        REQUIRE(p[3] == 0);
+        REQUIRE(p[7] == 0);
+        dev->put();
+
+        /* zeroes are persistent */
+        int fd = ::open(path.c_str(), O_RDONLY);
+        char buf[4] = {0};
+        REQUIRE(4 == pread(fd, buf, 4, 11));
+        REQUIRE(buf[0] == 0x5a);
+        REQUIRE(buf[2] == 0);
+        REQUIRE(4 == pread(fd, buf, 4, MB * 16 - 8));
+        REQUIRE(buf[0] == 0);
+        REQUIRE(buf[1] == 0x5a);
+        ::close(fd);
+        unlink(path.c_str());
+    }
+
+    /* memory devices zero with a worker pool, but can't fallocate */
+    nv_dev* dev = nv_dev::open("", MB * 32);
+    memset(dev->va(), 1, dev->size());
+    REQUIRE(0 == dev->zero(dev->va(), dev->size(), NV_ZERO_NT, 4));
+    REQUIRE(std::count((char*)dev->va(), (char*)dev->va() + dev->size(), 0) == MB * 32);
+    REQUIRE(-1 == dev->zero(dev->va(), dev->size(), NV_ZERO_FALLOCATE));
+    delete dev;
+}
+
+TEST_CASE("nvchunkTest16", "[write]") {
+    string path = "/tmp/dev_write";
+    unlink(path.c_str());
+
+    NVM::instance().clear();
+    nvchunk* pa = NVM::instance().openChunk("chunk_wa", path, 0, MB);
+    nvchunk* pb = NVM::instance().mapChunk("chunk_wb", pa->_pDev, 100, MB - 100);
+    REQUIRE(pa != nullptr);
+    REQUIRE(pb != nullptr);
+
+    /* small and large (streaming) writes */
+    std::vector<char> big(64 * KB + 3);
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = (char)(i * 7);
+    }
+    REQUIRE(0 == pa->write(3, "small", 6));
+    REQUIRE(0 == pa->write(1000, big.data(), big.size()));
+    REQUIRE(string((char*)pa->va() + 3) == "small");
+    REQUIRE(0 == memcmp((char*)pa->va() + 1000, big.data(), big.size()));
+
+    /* out of bounds */
+    REQUIRE(-1 == pa->write(MB - 2, "abc", 3));
+    REQUIRE(-1 == pa->write(-1, "abc", 3));
+
+    /* copy across chunks, overlapping ranges of the same device */
+    REQUIRE(0 == pb->copy_from(*pa, 0, 1000, big.size()));
+    REQUIRE(0 == memcmp((char*)pa->va() + 100, big.data(), big.size()));
+    REQUIRE(-1 == pb->copy_from(*pa, 0, MB - 10, 11));
+
+    /* a memory chunk takes the copy too */
+    nvchunk* pm = NVM::instance().openChunk("chunk_wm", "", 0, MB);
+    REQUIRE(0 == pm->copy_from(*pb, 10, 0, big.size()));
+    REQUIRE(0 == memcmp((char*)pm->va() + 10, big.data(), big.size()));
+
+    /* copies are persistent */
+    NVM::instance().clear();
+    pa = NVM::instance().openChunk("chunk_wa", path, 0, 0);
+    REQUIRE(string((char*)pa->va() + 3) == "small");
+    REQUIRE(0 == memcmp((char*)pa->va() + 100, big.data(), big.size()));
+    NVM::instance().clear();
+    unlink(path.c_str());
+
+    /* cpmem copy with streaming stores */
+#ifndef HAVE_LIBPMEM_H
+    std::vector<char> dst(big.size() + 64, 0);
+    for (size_t off = 0; off < 17; off += 5) {
+        pmem_memcpy(dst.data() + off, big.data(), big.size() - off, PMEM_F_MEM_NONTEMPORAL);
+        REQUIRE(0 == memcmp(dst.data() + off, big.data(), big.size() - off));
+    }
+#endif
+}
+
+TEST_CASE("nvchunkTest17", "[dirty]") {
+    string path = "/tmp/dev_dirty";
+    unlink(path.c_str());
+
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    nvchunk* pc = new nvchunk("chunk_dirty", dev, 100, MB * 2);
+    size_t pg = nv_pagesize();
+
+    /* nothing to flush */
+    uint64_t syncs = dev->nsyncs();
+    REQUIRE(pc->dirty_bytes() == 0);
+    REQUIRE(0 == pc->flush_dirty());
+    REQUIRE(dev->nsyncs() == syncs);
+
+    /* writes through the mapper are tracked */
+    auto recs = pc->getmapper<uint64_t>();
+    recs.set(0, 1);
+    recs.set(1, 2);
+    recs[pg * 10] = 3;
+    recs.mark_dirty(pg * 10);
+    pc->mark_dirty((char*)pc->va() + MB * 2 - 1, 100);     // clipped to the chunk
+    pc->mark_dirty((char*)pc->va() - 1000, 10);             // out of the chunk
+    REQUIRE(pc->dirty_bytes() == pg * 3);
+
+    /* synchronous write back of the dirty ranges only */
+    REQUIRE(0 == pc->flush_dirty());
+    REQUIRE(pc->dirty_bytes() == 0);
+    REQUIRE(dev->nsyncs() == syncs + 3);
+
+    /* asynchronous write back */
+    std::vector<std::future<int>> futures;
+    for (size_t i = 0; i < 100; i++) {
+        recs.set(i * 97, i);
+        futures.push_back(pc->flush_async());
+    }
+    for (auto & f : futures) {
+        REQUIRE(0 == f.get());
+    }
+    REQUIRE(pc->dirty_bytes() == 0);
+
+    /* a flush in flight is waited for, even if it took every range */
+    {
+        std::unique_lock<std::mutex> inflight(pc->mFlushLock);
+        std::future<int> f = pc->flush_async();
+        REQUIRE(f.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+        inflight.unlock();
+        REQUIRE(0 == f.get());
+    }
+
+    /* destroying a chunk waits for its pending flushes */
+    recs.set(5, 5);
+    std::future<int> last = pc->flush_async();
+    delete pc;
+    REQUIRE(0 == last.get());
+    delete dev;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    uint64_t v = 0;
+    REQUIRE(sizeof(v) == pread(fd, &v, sizeof(v), 100 + 97 * 99 * sizeof(v)));
+    REQUIRE(v == 99);
+    ::close(fd);
+    unlink(path.c_str());
+
+    /* memory chunks can't be flushed */
+    dev = nv_dev::open("", MB);
+    pc = new nvchunk("chunk_dirty_m", dev);
+    pc->mark_dirty(pc->va(), 1);
+    REQUIRE(EINVAL == pc->flush_async().get());
+    REQUIRE(pc->dirty_bytes() == pg);
+    delete pc;
+    delete dev;
+}
+
+TEST_CASE("nvchunkTest18", "[wrtrack]") {
+    string path = "/tmp/dev_wrtrack";
+    unlink(path.c_str());
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    nvchunk* pc = new nvchunk("chunk_wrtrack", dev, 0, MB * 4);
+    size_t pg = nv_pagesize();
+    char*  p  = (char*)pc->va();
+    nv_wrtrack & wt = nv_wrtrack::instance();
+    size_t ntracked = wt.ntracked();
+
+    /* written pages are found without mark_dirty */
+    REQUIRE(0 == pc->track_writes());
+    REQUIRE(wt.ntracked() == ntracked + 1);
+    REQUIRE(pc->dirty_bytes() == 0);
+    p[pg * 3] = 1;
+    p[pg * 3 + 1] = 2;
+    p[pg * 700 + 5] = 3;
+    REQUIRE(pc->dirty_bytes() == pg * 2);
+    uint64_t syncs = dev->nsyncs();
+    REQUIRE(0 == pc->flush_dirty());
+    REQUIRE(dev->nsyncs() == syncs + 2);
+    REQUIRE(pc->dirty_bytes() == 0);
+
+    /* flushed pages are tracked again, reads don't mark them */
+    REQUIRE(p[pg * 700 + 5] == 3);
+    REQUIRE(pc->dirty_bytes() == 0);
+    p[pg * 3] = 4;
+    REQUIRE(pc->dirty_bytes() == pg);
+    REQUIRE(0 == pc->write(pg * 10, "abc", 3));
+    REQUIRE(pc->dirty_bytes() == pg * 2);
+    REQUIRE(0 == pc->flush_dirty());
+
+    /* a writer racing with flushes: what it writes after the last 
+       flush is dirty */
+    std::atomic<int> phase(0);
+    std::thread writer([&]() {
+        for (size_t i = 0; phase == 0; i++) {
+            __atomic_store_n(&p[(i * 7919 % 1024) * pg], (char)i, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&p[77 * pg], 1, __ATOMIC_RELAXED);
+    });
+    for (int i = 0; i < 200; i++) {
+        REQUIRE(0 == pc->flush_dirty());
+    }
+    phase = 1;
+    writer.join();
+    REQUIRE(pc->mDirtyGran == pg);
+    REQUIRE((pc->mDirty.load()[1] & (1ull << (77 - 64))) != 0);
+    REQUIRE(0 == pc->flush_dirty());
+    REQUIRE(pc->dirty_bytes() == 0);
+    for (size_t i = 0; i < 1024; i++) {
+        p[i * pg] = 0;
+    }
+    REQUIRE(pc->dirty_bytes() == pg * 1024);
+    REQUIRE(0 == pc->flush_dirty());
+
+    /* misaligned chunks can't be tracked */
+    nvchunk* pm = new nvchunk("chunk_wrtrack_mis", dev, 0, pg + 100);
+    REQUIRE(-1 == pm->track_writes());
+    REQUIRE(errno == EINVAL);
+    delete pm;
+
+    /* untracked chunks are writable and no longer marked */
+    pc->untrack_writes();
+    REQUIRE(wt.ntracked() == ntracked);
+    p[pg * 5] = 1;
+    REQUIRE(pc->dirty_bytes() == 0);
+
+    /* a chunk is untracked when deleted */
+    REQUIRE(0 == pc->track_writes());
+    delete pc;
+    REQUIRE(wt.ntracked() == ntracked);
+    dev->put();
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest19", "[drain]") {
+    string path1 = "/tmp/dev_drain1", path2 = "/tmp/dev_drain2";
+    unlink(path1.c_str());
+    unlink(path2.c_str());
+
+    NVM::instance().clear();
+    nvchunk* pa = NVM::instance().openChunk("chunk_da", path1, 0, MB);
+    nvchunk* pb = NVM::instance().openChunk("chunk_db", path2, 0, MB);
+    nvchunk* pm = NVM::instance().openChunk("chunk_dm", "", 0, MB);
+    REQUIRE(pa != nullptr);
+    REQUIRE(pb != nullptr);
+    REQUIRE(pm != nullptr);
+
+    /* flush without drain, then one drain */
+    auto ra = pa->getmapper<uint64_t>();
+    uint64_t syncs = pa->dev()->nsyncs();
+    for (size_t i = 0; i < 100; i++) {
+        ra[i * 3] = i;
+        ra.flush_nodrain(i * 3);
+    }
+    REQUIRE(pa->dev()->nsyncs() == syncs);
+    ra.drain();
+    REQUIRE(pa->dev()->nsyncs() == syncs + 1);
+    REQUIRE(0 == pa->drain());                  // nothing left to drain
+    REQUIRE(pa->dev()->nsyncs() == syncs + 1);
+    REQUIRE(-1 == pm->flush_nodrain(pm->va(), 8));
+    REQUIRE(-1 == pm->drain());
+
+    /* a batch across chunks and devices drains once per device */
+    nv_persistbatch batch;
+    auto rb = pb->getmapper<uint64_t>();
+    uint64_t syncs_a = pa->dev()->nsyncs(), syncs_b = pb->dev()->nsyncs();
+    for (size_t i = 0; i < 100; i++) {
+        ra[i * 5 + 1] = i;
+        rb[i * 5 + 2] = i;
+        batch.add(pa, &ra[i * 5 + 1], sizeof(uint64_t));
+        batch.add(pb, &rb[i * 5 + 2], sizeof(uint64_t));
+        batch.add(pm, pm->va(), 8);             // nothing to persist
+    }
+    REQUIRE(batch.size() == 200);
+    REQUIRE(batch.ndevs() == 2);
+    REQUIRE(0 == batch.commit());
+    REQUIRE(batch.size() == 0);
+    REQUIRE(pa->dev()->nsyncs() == syncs_a + 1);
+    REQUIRE(pb->dev()->nsyncs() == syncs_b + 1);
+
+    NVM::instance().clear();
+    pb = NVM::instance().openChunk("chunk_db", path2, 0, 0);
+    REQUIRE(pb->getmapper<uint64_t>()[99 * 5 + 2] == 99);
+    NVM::instance().clear();
+    unlink(path1.c_str());
+    unlink(path2.c_str());
+}
+
+TEST_CASE("nvchunkTest20", "[groupcommit]") {
+    const size_t nthreads = 8, ncommits = 200;
+    string path = "/tmp/dev_group";
+    unlink(path.c_str());
+
+    nv_dev* dev = nv_dev::open(path, MB * 4);
+    REQUIRE(dev != nullptr);
+    dev->set_group_commit(std::chrono::microseconds(200), MB);
+    nvchunk pc("chunk_group", dev);
+    auto recs = pc.getmapper<uint64_t>();
+
+    std::atomic<size_t> failed(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < ncommits; i++) {
+                size_t idx = (i * nthreads + t) * 16;
+                recs[idx] = idx + 1;
+                if (pc.group_flush(&recs[idx], sizeof(uint64_t)) != 0) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    INFO("group commit: " << nthreads * ncommits / secs << " commits/s in " 
+         << dev->ngroupcommits() << " epochs");
+
+    REQUIRE(failed == 0);
+    REQUIRE(dev->ngroupcommits() > 0);
+    REQUIRE(dev->ngroupcommits() < nthreads * ncommits);
+    dev->put();
+
+    /* every commit is durable */
+    dev = nv_dev::open(path, 0);
+    uint64_t* r = (uint64_t*)dev->va();
+    size_t bad = 0;
+    for (size_t i = 0; i < nthreads * ncommits; i++) {
+        bad += r[i * 16] != i * 16 + 1;
+    }
+    REQUIRE(bad == 0);
+
+    /* a byte budget closes epochs early, a single thread needn't wait the window */
+    dev->set_group_commit(std::chrono::microseconds(10 * 1000 * 1000), 1);
+    auto t0 = std::chrono::steady_clock::now();
+    REQUIRE(0 == dev->group_flush(r, 8));
+    REQUIRE(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5));
+    delete dev;
+    unlink(path.c_str());
+
+    /* errors are reported to every thread of the epoch */
+    dev = nv_dev::open("", MB);
+    REQUIRE(-1 == dev->group_flush(dev->va(), 8));
+    REQUIRE(errno == EINVAL);
+    delete dev;
+}
+
+TEST_CASE("nvchunkTest21", "[openmode]") {
+    string path = "/tmp/dev_openmode";
+    unlink(path.c_str());
+
+    nv_dev* dev = nv_dev::open(path, MB);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->mode() == NV_OPEN_RDWR);
+    strcpy((char*)dev->va() + 100, "persisted");
+    REQUIRE(0 == dev->flush());
+    delete dev;
+
+    /* read-only: data is shared with the file, nothing can be written */
+    nv_devopts opts;
+    opts.mode    = NV_OPEN_RDONLY;
+    opts.reserve = MB * 4;
+    dev = nv_dev::open(path, 0, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(dev->mode() == NV_OPEN_RDONLY);
+    REQUIRE(dev->size() == MB);
+    REQUIRE(string((char*)dev->va() + 100) == "persisted");
+    REQUIRE(-1 == dev->flush());
+    REQUIRE(errno == EROFS);
+    REQUIRE(-1 == dev->flush_nodrain(dev->va(), 8));
+    REQUIRE(errno == EROFS);
+    REQUIRE(-1 == dev->write(dev->va(), "x", 1));
+    REQUIRE(errno == EROFS);
+    REQUIRE(-1 == dev->zero());
+    REQUIRE(errno == EROFS);
+    REQUIRE(-1 == dev->grow(MB * 2));
+    REQUIRE(errno == EROFS);
+    delete dev;
+
+    /* read-only devices are never created */
+    REQUIRE(nullptr == nv_dev::open(path, MB, true, opts));
+    REQUIRE(errno == EROFS);
+    REQUIRE(nullptr == nv_dev::open("/tmp/dev_openmode_none", MB, false, opts));
+    REQUIRE(errno == ENOENT);
+    REQUIRE(nullptr == nv_dev::open(path, MB * 2, false, opts));
+    REQUIRE(errno == EINVAL);
+    REQUIRE(nullptr == nv_dev::open("", MB, false, opts));
+
+    /* copy-on-write: writes stay private */
+    opts.mode = NV_OPEN_COW;
+    dev = nv_dev::open(path, 0, false, opts);
+    REQUIRE(dev != nullptr);
+    strcpy((char*)dev->va() + 100, "scratch");
+    REQUIRE(string((char*)dev->va() + 100) == "scratch");
+    REQUIRE(-1 == dev->flush((char*)dev->va() + 100, 8));
+    REQUIRE(errno == EROFS);
+    delete dev;
+
+    /* through NVM, a device is open in one mode only */
+    opts.mode = NV_OPEN_RDONLY;
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_ro", path, 0, 0, opts);
+    REQUIRE(pc != nullptr);
+    REQUIRE(string((char*)pc->va() + 100) == "persisted");
+    REQUIRE(-1 == pc->write(0, "x", 1));
+    REQUIRE(errno == EROFS);
+    REQUIRE(nullptr == NVM::instance().openChunk("chunk_rw", path, 0, MB));
+    REQUIRE(errno == EBUSY);
+    NVM::instance().clear();
+
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest22", "[snapshot]") {
+    string path = "/tmp/dev_snap";
+    string snap = "/tmp/dev_snap.bak";
+    unlink(path.c_str());
+    unlink(snap.c_str());
+
+    /* large enough to be copied by several threads */
+    const size_t size = NV_COPY_SLICE * 3 + 12345;
+    NVM::instance().clear();
+    nvchunk* pa = NVM::instance().openChunk("chunk_snap_a", path, 0, size);
+    nvchunk* pb = NVM::instance().mapChunk("chunk_snap_b", pa->dev(), 1000, 5000);
+    REQUIRE(pa != nullptr);
+    REQUIRE(pb != nullptr);
+    REQUIRE(pb->offset() == 1000);
+    char* p = (char*)pa->va();
+    for (size_t off = 0; off < size; off += 4096) {
+        p[off] = (char)(off / 4096);
+    }
+    strcpy(p + 1000, "chunk b");
+    strcpy(p + size - 10, "tail");
+
+    /* whole device, stores before the call are in the copy */
+    REQUIRE(0 == pa->dev()->snapshot(snap, 0, 0, 4));
+    strcpy(p + 1000, "changed");
+    nv_dev* ds = nv_dev::open(snap);
+    REQUIRE(ds != nullptr);
+    REQUIRE(ds->size() == size);
+    REQUIRE(0 == memcmp(ds->va(), p, 1000));
+    REQUIRE(string((char*)ds->va() + 1000) == "chunk b");
+    REQUIRE(0 == memcmp((char*)ds->va() + 2000, p + 2000, size - 2000));
+    delete ds;
+
+    /* a single chunk at an unaligned offset */
+    REQUIRE(0 == NVM::instance().snapshotChunk("chunk_snap_b", snap));
+    ds = nv_dev::open(snap);
+    REQUIRE(ds->size() == 5000);
+    REQUIRE(string((char*)ds->va()) == "changed");
+    REQUIRE(0 == memcmp(ds->va(), p + 1000, 5000));
+    delete ds;
+
+    /* errors leave nothing behind */
+    REQUIRE(-1 == pa->dev()->snapshot(path));
+    REQUIRE(errno == EINVAL);
+    REQUIRE(-1 == pa->dev()->snapshot(snap, size, 1));
+    REQUIRE(errno == EINVAL);
+    REQUIRE(-1 == NVM::instance().snapshotChunk("chunk_snap_none", snap));
+    REQUIRE(errno == ENOENT);
+    REQUIRE(NVM::instance().openChunk("chunk_snap_mem", "", 0, MB) != nullptr);
+    REQUIRE(-1 == NVM::instance().snapshotChunk("chunk_snap_mem", snap));
+    REQUIRE(errno == ENOTSUP);
+
+    NVM::instance().clear();
+    unlink(path.c_str());
+    unlink(snap.c_str());
+}
+
+TEST_CASE("nvchunkTest23", "[alloc]") {
+    string path = "/tmp/dev_alloc";
+    struct stat st;
+    unlink(path.c_str());
+
+    /* sparse by default */
+    nv_dev* dev = nv_dev::open(path, MB * 8);
+    REQUIRE(dev != nullptr);
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE((size_t)st.st_blocks * 512 < MB);
+    delete dev;
+    unlink(path.c_str());
+
+    /* new, resized and grown files are allocated up front */
+    nv_devopts opts;
+    opts.alloc       = NV_ALLOC_FALLOCATE;
+    opts.alloc_align = MB * 2;
+    dev = nv_dev::open(path, MB * 8, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE(st.st_size == MB * 8);
+    REQUIRE((size_t)st.st_blocks * 512 >= MB * 8);
+    delete dev;
+
+    dev = nv_dev::open(path, MB * 12, true, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE(st.st_size == MB * 12);
+    REQUIRE((size_t)st.st_blocks * 512 >= MB * 12);
+    delete dev;
+    unlink(path.c_str());
+
+    opts.reserve = MB * 64;
+    dev = nv_dev::open(path, MB, false, opts);
+    REQUIRE(dev != nullptr);
+    REQUIRE(0 == dev->grow(MB * 16));
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE(st.st_size == MB * 16);
+    REQUIRE((size_t)st.st_blocks * 512 >= MB * 16);
+    strcpy((char*)dev->va() + MB * 15, "allocated");
+    REQUIRE(0 == dev->flush());
+    delete dev;
+
+    dev = nv_dev::open(path);
+    REQUIRE(string((char*)dev->va() + MB * 15) == "allocated");
+    delete dev;
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest24", "[discard]") {
+    string path = "/tmp/dev_discard";
+    struct stat st;
+    size_t pg = nv_pagesize();
+    unlink(path.c_str());
+
+    nv_devopts opts;
+    opts.alloc = NV_ALLOC_FALLOCATE;
+    NVM::instance().clear();
+    nvchunk* pf = NVM::instance().openChunk("chunk_discard_f", path, 0, MB * 4, opts);
+    nvchunk* pm = NVM::instance().openChunk("chunk_discard_m", "", 0, MB * 4);
+    nv_devopts sopts;
+    sopts.shared = true;
+    nvchunk* ps = NVM::instance().openChunk("chunk_discard_s", "", 0, MB * 4, sopts);
+    REQUIRE(pf != nullptr);
+    REQUIRE(pm != nullptr);
+    REQUIRE(ps != nullptr);
+
+    for (nvchunk* pc : { pf, pm, ps }) {
+        char* p = (char*)pc->va();
+        memset(p, 0xab, pc->size());
+
+        /* unaligned range: whole pages released, edges zeroed */
+        REQUIRE(0 == pc->discard(100, MB * 2));
+
+        /* the released pages are no longer resident, until read */
+        unsigned char vec[16];
+        REQUIRE(0 == mincore(p + pg, pg * 16, vec));
+        size_t resident = 0;
+        for (unsigned char v : vec) {
+            resident += v & 1;
+        }
+        REQUIRE(resident == 0);
+
+        std::vector<char> zeros(MB * 2, 0);
+        REQUIRE(0 == memcmp(p + 100, zeros.data(), MB * 2));
+        REQUIRE((unsigned char)p[99] == 0xab);
+        REQUIRE((unsigned char)p[100 + MB * 2] == 0xab);
+
+        /* within a page */
+        REQUIRE(0 == pc->discard(MB * 3 + 10, 20));
+        REQUIRE(p[MB * 3 + 10] == 0);
+        REQUIRE(p[MB * 3 + 29] == 0);
+        REQUIRE((unsigned char)p[MB * 3 + 30] == 0xab);
+
+        REQUIRE(-1 == pc->discard(MB * 4 - 10, 20));
+        REQUIRE(errno == EINVAL);
+    }
+
+    /* the blocks of the file are freed, the size is kept */
+    REQUIRE(0 == stat(path.c_str(), &st));
+    REQUIRE(st.st_size == MB * 4);
+    REQUIRE((size_t)st.st_blocks * 512 <= MB * 2 + pg * 2);
+    NVM::instance().clear();
+
+    nv_dev* dev = nv_dev::open(path);
+    REQUIRE(((char*)dev->va())[MB] == 0);
+    REQUIRE((unsigned char)((char*)dev->va())[MB * 3] == 0xab);
+    delete dev;
+
+    opts.mode = NV_OPEN_RDONLY;
+    dev = nv_dev::open(path, 0, false, opts);
+    REQUIRE(-1 == dev->discard(dev->va(), MB));
+    REQUIRE(errno == EROFS);
+    delete dev;
+    unlink(path.c_str());
+}
+
+/* VmFlags of the mapping holding addr in /proc/self/smaps */
+static string vm_flags(void* addr) {
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool found = false;
+    while (getline(smaps, line)) {
+        uintptr_t b, e;
+        if (sscanf(line.c_str(), "%lx-%lx ", &b, &e) == 2 && line.find(':') > line.find(' ')) {
+            found = b <= (uintptr_t)addr && (uintptr_t)addr < e;
+        }
+        else if (found && line.compare(0, 8, "VmFlags:") == 0) {
+            return line.substr(8) + " ";
+        }
+    }
+    return "";
+}
+
+TEST_CASE("nvchunkTest25", "[advise]") {
+    string path = "/tmp/dev_advise";
+    size_t pg = nv_pagesize();
+    unlink(path.c_str());
+
+    nv_devopts opts;
+    opts.reserve = MB * 64;
+    NVM::instance().clear();
+    nvchunk* pa = NVM::instance().openChunk("chunk_advise_a", path, 0, MB + 100, opts);
+    nvchunk* pb = NVM::instance().mapChunk("chunk_advise_b", pa->dev(), MB + 100, MB);
+    REQUIRE(pa != nullptr);
+    REQUIRE(pb != nullptr);
+    nv_dev* dev = pa->dev();
+    char*   p   = (char*)dev->va();
+    REQUIRE(0 == dev->grow(MB * 4));
+
+    /* unaligned chunks are widened to whole pages */
+    REQUIRE(0 == pa->advise(NV_ADVISE_SEQUENTIAL));
+    REQUIRE(0 == pb->advise(NV_ADVISE_RANDOM, 10, pg * 4));
+    REQUIRE(vm_flags(p).find(" sr ") != string::npos);
+    REQUIRE(vm_flags(p + MB).find(" rr ") != string::npos);
+    REQUIRE(vm_flags(p + MB + pg * 3).find(" rr ") != string::npos);
+    REQUIRE(vm_flags(p + MB + pg * 6).find(" sr ") == string::npos);
+    REQUIRE(vm_flags(p + MB + pg * 6).find(" rr ") == string::npos);
+
+    /* a pattern for the whole device covers what grow() adds */
+    REQUIRE(0 == dev->advise(nullptr, 0, NV_ADVISE_RANDOM));
+    REQUIRE(vm_flags(p).find(" rr ") != string::npos);
+    REQUIRE(0 == pa->advise(NV_ADVISE_SEQUENTIAL, 0, pg));
+    REQUIRE(0 == dev->grow(MB * 8));
+    REQUIRE(vm_flags(p + MB * 6).find(" rr ") != string::npos);
+    REQUIRE(vm_flags(p).find(" sr ") != string::npos);
+
+    REQUIRE(-1 == pa->advise(NV_ADVISE_RANDOM, MB * 2));
+    REQUIRE(errno == EINVAL);
+    REQUIRE(-1 == pa->advise((nv_advice)42));
+    REQUIRE(errno == EINVAL);
+
+    NVM::instance().clear();
+    unlink(path.c_str());
+}
+
+TEST_CASE("nvchunkTest26", "[warmup]") {
+    string path = "/tmp/dev_warmup";
+    const size_t size = MB * 16;
+    size_t pg = nv_pagesize();
+    unlink(path.c_str());
+
+    nv_dev* dev = nv_dev::open(path, size);
+    REQUIRE(dev != nullptr);
+    memset(dev->va(), 1, size);
+    REQUIRE(0 == dev->flush());
+    delete dev;
+
+    /* drop the file from the page cache */
+    int fd = open(path.c_str(), O_RDONLY);
+    REQUIRE(0 == posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+    close(fd);
+
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_warm", path, 0, size);
+    REQUIRE(pc != nullptr);
+    char* p = (char*)pc->va();
+    auto resident = [&](char* a, size_t len) {
+        std::vector<unsigned char> vec(len / pg);
+        REQUIRE(0 == mincore(a, len, vec.data()));
+        size_t n = 0;
+        for (unsigned char v : vec) {
+            n += v & 1;
+        }
+        return n;
+    };
+
+    /* hot ranges only */
+    std::vector<nv_range> hot = { { p + MB, MB }, { p + MB * 8, MB * 2 } };
+    auto w = pc->warmup(hot);
+    REQUIRE(w != nullptr);
+    REQUIRE(w->total() == MB * 3);
+    REQUIRE(0 == w->wait());
+    REQUIRE(w->done());
+    REQUIRE(w->progress() == MB * 3);
+    for (int i = 0; i < 100 && resident(p + MB * 8, MB * 2) < MB * 2 / pg; i++) {
+        usleep(10000);
+    }
+    REQUIRE(resident(p + MB * 8, MB * 2) == MB * 2 / pg);
+
+    /* the whole chunk, the warm-up outlives the device */
+    w = pc->warmup();
+    REQUIRE(w != nullptr);
+    REQUIRE(w->total() == size);
+    NVM::instance().clear();
+    REQUIRE(0 == w->wait());
+    REQUIRE(w->progress() == size);
+
+    dev = nv_dev::open("", MB);
+    REQUIRE(nullptr == dev->warmup({ { p, MB } }));
+    REQUIRE(errno == EINVAL);
+    w = dev->warmup();
+    REQUIRE(0 == w->wait());
+    delete dev;
+
+    /* cancel */
+    std::atomic<size_t> calls(0);
+    auto slow = [&calls](void*, size_t) { calls++; usleep(1000); return 0; };
+    w = std::make_shared<nv_warmup>(slow, std::vector<nv_range>{ { p, (size_t)NV_WARM_SLICE * 1000 } });
+    while (calls.load() < 3) {
+        usleep(1000);
+    }
+    w->cancel();
+    REQUIRE(-1 == w->wait());
+    REQUIRE(errno == ECANCELED);
+    REQUIRE(w->progress() < w->total());
+    REQUIRE(w->progress() == calls.load() * NV_WARM_SLICE);
+
+    /* dropping the handle leaves the warm-up running */
+    std::atomic<size_t> nread(0);
+    auto counting = [&nread](void*, size_t len) { usleep(1000); nread += len; return 0; };
+    w = std::make_shared<nv_warmup>(counting, std::vector<nv_range>{ { p, (size_t)NV_WARM_SLICE * 20 } });
+    w.reset();
+    for (int i = 0; i < 1000 && nread.load() < (size_t)NV_WARM_SLICE * 20; i++) {
+        usleep(1000);
+    }
+    REQUIRE(nread.load() == (size_t)NV_WARM_SLICE * 20);
+
+    /* errors */
+    auto bad = [](void*, size_t) { errno = EIO; return -1; };
+    w = std::make_shared<nv_warmup>(bad, std::vector<nv_range>{ { p, MB } });
+    REQUIRE(-1 == w->wait());
+    REQUIRE(errno == EIO);
+    REQUIRE(w->progress() == 0);
+
+    unlink(path.c_str());
+}
+
+static size_t nopenfds() {
+    size_t n = 0;
+    DIR* d = opendir("/proc/self/fd");
+    while (readdir(d)) {
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+TEST_CASE("nvchunkTest27", "[lazy]") {
+    const int ndevs = 8;
+    const size_t size = 64 * KB;
+    std::vector<string> paths;
+    for (int i = 0; i < ndevs; i++) {
+        paths.push_back("/tmp/dev_lazy" + std::to_string(i));
+        unlink(paths[i].c_str());
+    }
+    nv_lazymap & lm = nv_lazymap::instance();
+    REQUIRE(lm.nmapped() == 0);
+
+    /* neither a mapping nor an fd until first use */
+    nv_devopts opts;
+    opts.lazy = true;
+    size_t nfds = nopenfds();
+    std::vector<nv_dev*> devs;
+    for (int i = 0; i < ndevs; i++) {
+        devs.push_back(nv_dev::open(paths[i], size, false, opts));
+        REQUIRE(devs[i] != nullptr);
+        REQUIRE(devs[i]->is_lazy());
+        REQUIRE(!devs[i]->is_mapped());
+        REQUIRE(devs[i]->size() == size);
+    }
+    REQUIRE(nopenfds() == nfds);
+    REQUIRE(lm.nmapped() == 0);
+
+    /* mapped devices hold none either, calls that need one reopen the file */
+    {
+        nv_devopts gopts;
+        gopts.reserve = MB;
+        unlink("/tmp/dev_nofd");
+        nv_dev* dev = nv_dev::open("/tmp/dev_nofd", size, false, gopts);
+        REQUIRE(dev != nullptr);
+        REQUIRE(nopenfds() == nfds);
+        REQUIRE(0 == dev->grow(size * 2));
+        REQUIRE(0 == dev->zero(dev->va(), size * 2, NV_ZERO_FALLOCATE));
+        REQUIRE(nopenfds() == nfds);
+        /* a file that took the place of the mapped one is left alone */
+        unlink("/tmp/dev_nofd");
+        int fd = open("/tmp/dev_nofd", O_RDWR | O_CREAT, 0666);
+        REQUIRE(fd != -1);
+        close(fd);
+        REQUIRE(-1 == dev->grow(size * 3));
+        REQUIRE(errno == ESTALE);
+        struct stat st;
+        REQUIRE(0 == stat("/tmp/dev_nofd", &st));
+        REQUIRE(st.st_size == 0);
+        delete dev;
+        unlink("/tmp/dev_nofd");
+    }
+
+    /* concurrent first use maps once */
+    std::vector<void*> vas(8);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < vas.size(); t++) {
+        threads.emplace_back([&, t] { vas[t] = devs[0]->va(); });
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    REQUIRE(vas[0] != nullptr);
+    REQUIRE(std::count(vas.begin(), vas.end(), vas[0]) == (long)vas.size());
+    REQUIRE(devs[0]->is_mapped());
+    REQUIRE(lm.nmapped() == 1);
+
+    for (int i = 0; i < ndevs; i++) {
+        REQUIRE(0 == devs[i]->write(devs[i]->va(), paths[i].c_str(), paths[i].size() + 1));
+    }
+    REQUIRE(lm.nmapped() == ndevs);
+    REQUIRE(0 == devs[0]->advise(nullptr, 0, NV_ADVISE_RANDOM));
+
+    /* idle devices are unmapped under a budget, pinned ones stay mapped */
+    REQUIRE(devs[1]->pin() != nullptr);
+    uint64_t nev = lm.nevictions();
+    lm.set_budget(3);
+    REQUIRE(lm.nmapped() == 3);
+    REQUIRE(devs[1]->is_mapped());
+    REQUIRE(lm.nevictions() - nev == ndevs - 3);
+    for (int i = 0; i < ndevs; i++) {
+        REQUIRE(string((char*)devs[i]->va()) == paths[i]);
+        REQUIRE(devs[1]->is_mapped());
+        REQUIRE(lm.nmapped() <= 3);
+    }
+    devs[1]->unpin();
+    REQUIRE(nopenfds() == nfds);
+
+    /* patterns are reapplied on remap */
+    REQUIRE(!devs[0]->is_mapped());
+    REQUIRE(vm_flags(devs[0]->va()).find(" rr ") != string::npos);
+
+    /* chunks follow the device wherever it's mapped */
+    NVM::instance().clear();
+    nvchunk* pc = NVM::instance().openChunk("chunk_lazy", paths[2], 100, 1000, opts);
+    REQUIRE(pc != nullptr);
+    REQUIRE(pc->offset() == 100);
+    REQUIRE(0 == pc->write(0, "chunk", 6));
+    REQUIRE(0 == pc->flush());
+    for (int i = 3; i < ndevs; i++) {
+        devs[i]->va();
+    }
+    REQUIRE(!pc->dev()->is_mapped());
+    {
+        /* a guard pins for its scope */
+        nv_dev::pinned pin(pc->dev());
+        REQUIRE(pin.va() != nullptr);
+        for (int i = 3; i < ndevs; i++) {
+            devs[i]->va();
+        }
+        REQUIRE(pc->dev()->is_mapped());
+        REQUIRE(string((char*)pin.va() + 100) == "chunk");
+        REQUIRE(0 == pc->write(0, "pinned", 7));
+        REQUIRE(0 == pc->flush());
+    }
+    for (int i = 3; i < ndevs; i++) {
+        devs[i]->va();
+    }
+    REQUIRE(!pc->dev()->is_mapped());
+    REQUIRE(string((char*)pc->va()) == "pinned");
+    NVM::instance().clear();
+
+    lm.set_budget(0);
+    for (auto d : devs) {
+        delete d;
+    }
+    REQUIRE(lm.nmapped() == 0);
+    REQUIRE(nopenfds() == nfds);
+
+    /* lazy devices are created and sized up front */
+    opts.alloc = NV_ALLOC_FALLOCATE;
+    unlink(paths[0].c_str());
+    nv_dev* dev = nv_dev::open(paths[0], MB, false, opts);
+    struct stat st;
+    REQUIRE(0 == stat(paths[0].c_str(), &st));
+    REQUIRE(st.st_size == MB);
+    REQUIRE((size_t)st.st_blocks * 512 >= MB);
+    delete dev;
+
+    for (auto & p : paths) {
+        unlink(p.c_str());
+    }
+}
+
+TEST_CASE("nvchunkTest28", "[openchunks]") {
+    const int nfiles = 16, nper = 4;
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    std::vector<nv_chunkspec> specs;
+    for (int f = 0; f < nfiles; f++) {
+        string path = "/tmp/dev_bulk" + std::to_string(f);
+        unlink(path.c_str());
+        for (int c = 0; c < nper; c++) {
+            specs.push_back(nv_chunkspec("bulk_" + std::to_string(f) + "_" + std::to_string(c), 
+                                         path, c * 64 * KB, 64 * KB));
+        }
+    }
+    for (int m = 0; m < 4; m++) {
+        specs.push_back(nv_chunkspec("bulk_mem" + std::to_string(m), "", 0, MB));
+    }
+    nvchunk* existing = nvm.openChunk("bulk_existing", "", 0, MB);
+    specs.push_back(nv_chunkspec("bulk_existing", "", 0, MB));
+    specs.push_back(nv_chunkspec("bulk_bad", "/tmp/no_such_dir/dev", 0, MB));
+    specs.push_back(nv_chunkspec("bulk_bad_dup", "/tmp/no_such_dir/dev", 0, MB));
+    specs.push_back(nv_chunkspec("bulk_0_1", "/tmp/dev_bulk0", 0, 1000));
+    specs.push_back(nv_chunkspec("bulk_bad", "", 0, MB));
+    size_t ndevs = nvm.ndevs();
+
+    auto res = nvm.openChunks(specs, 4);
+    REQUIRE(res.size() == specs.size());
+
+    /* one device per file, and one per memory chunk */
+    REQUIRE(nvm.ndevs() == ndevs + nfiles + 4);
+    std::set<nv_dev*> devs;
+    for (int f = 0; f < nfiles; f++) {
+        for (int c = 0; c < nper; c++) {
+            nv_chunkresult & r = res[f * nper + c];
+            REQUIRE(r.chunk != nullptr);
+            REQUIRE(r.err == 0);
+            REQUIRE(r.chunk->offset() == (size_t)c * 64 * KB);
+            REQUIRE(r.chunk->size() == 64 * KB);
+            REQUIRE(r.chunk->dev() == res[f * nper].chunk->dev());
+            REQUIRE(nvm.getChunk(specs[f * nper + c].name) == r.chunk);
+        }
+        /* large enough for all its chunks */
+        REQUIRE(res[f * nper].chunk->dev()->size() == (size_t)nper * 64 * KB);
+        devs.insert(res[f * nper].chunk->dev());
+    }
+    REQUIRE(devs.size() == nfiles);
+
+    size_t i = nfiles * nper;
+    for (int m = 0; m < 4; m++, i++) {
+        REQUIRE(res[i].chunk != nullptr);
+        REQUIRE(res[i].chunk->dev()->is_persistent() == false);
+    }
+    REQUIRE(res[i++].chunk == existing);
+    REQUIRE(res[i].chunk == nullptr);
+    REQUIRE(res[i++].err == ENOENT);
+    REQUIRE(res[i].chunk == nullptr);
+    REQUIRE(res[i++].err == ENOENT);
+    /* a name opens one chunk, whatever the later specs say */
+    REQUIRE(res[i++].chunk == res[1].chunk);
+    REQUIRE(res[i].chunk == nullptr);
+    REQUIRE(res[i++].err == ENOENT);
+
+    /* devices already open are reused */
+    ndevs = nvm.ndevs();
+    nv_devopts ro;
+    ro.mode = NV_OPEN_RDONLY;
+    res = nvm.openChunks({ nv_chunkspec("bulk_more", "/tmp/dev_bulk3", 0, 100),
+                           nv_chunkspec("bulk_ro", "/tmp/dev_bulk3", 0, 100, ro) });
+    REQUIRE(nvm.ndevs() == ndevs);
+    REQUIRE(res[0].chunk->dev() == nvm.getChunk("bulk_3_0")->dev());
+    REQUIRE(res[1].chunk == nullptr);
+    REQUIRE(res[1].err == EBUSY);
+
+    nvm.clear();
+    for (int f = 0; f < nfiles; f++) {
+        unlink(("/tmp/dev_bulk" + std::to_string(f)).c_str());
+    }
+}
+
+TEST_CASE("nvchunkTest29", "[registry]") {
+    /* the index itself, enough names to grow the tables of every shard */
+    nv_registry<int> reg;
+    std::vector<int> vals(10000);
+    for (size_t i = 0; i < vals.size(); i++) {
+        vals[i] = i;
+        REQUIRE(reg.insert("k" + std::to_string(i), &vals[i]) == &vals[i]);
+    }
+    REQUIRE(reg.size() == vals.size());
+    int other = -1;
+    REQUIRE(reg.insert("k7", &other) == &vals[7]);
+    REQUIRE(reg.size() == vals.size());
+    for (size_t i = 0; i < vals.size(); i++) {
+        REQUIRE(reg.get("k" + std::to_string(i)) == &vals[i]);
+    }
+    REQUIRE(reg.get("nokey") == nullptr);
+    for (size_t i = 0; i < vals.size(); i += 2) {
+        REQUIRE(reg.remove("k" + std::to_string(i)) == &vals[i]);
+    }
+    REQUIRE(reg.remove("k0") == nullptr);
+    REQUIRE(reg.size() == vals.size() / 2);
+    size_t n = 0;
+    reg.for_each([&n](const string & key, int* v) {
+        n++;
+        return key == "k" + std::to_string(*v) && *v % 2;
+    });
+    REQUIRE(n == vals.size() / 2);
+
+    /* retired objects are freed once readers are done */
+    std::atomic<int> freed(0);
+    {
+        nv_ebr::guard g;
+        nv_ebr::instance().retire([&freed]() { freed++; });
+        nv_ebr::instance().retire([&freed]() { freed++; });
+        REQUIRE(freed == 0);
+    }
+    nv_ebr::instance().synchronize();
+    REQUIRE(freed == 2);
+
+    /* names are unique */
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+    nvchunk* pc = nvm.openChunk("reg_a", "", 0, MB);
+    REQUIRE(pc != nullptr);
+    errno = 0;
+    REQUIRE(nvm.mapChunk("reg_a", pc->dev(), 0, 100) == nullptr);
+    REQUIRE(errno == EEXIST);
+    REQUIRE(nvm.getChunk("reg_a") == pc);
+
+    /* threads opening one file share its device */
+    unlink("/tmp/dev_reg");
+    std::vector<nv_dev*> opened(4);
+    std::vector<std::thread> ths;
+    for (size_t t = 0; t < opened.size(); t++) {
+        ths.emplace_back([&opened, t]() {
+            opened[t] = NVM::instance().openDev("/tmp/dev_reg", MB);
+        });
+    }
+    for (auto & th : ths) {
+        th.join();
+    }
+    ths.clear();
+    for (auto pd : opened) {
+        REQUIRE(pd != nullptr);
+        REQUIRE(pd == opened[0]);
+    }
+    REQUIRE(nvm.ndevs() == 2);
+
+    /* lookups run while other chunks come and go */
+    const int nstable = 1000;
+    for (int i = 0; i < nstable; i++) {
+        REQUIRE(nvm.mapChunk("reg_s" + std::to_string(i), opened[0], i * 64, 64) != nullptr);
+    }
+    std::atomic<bool> stop(false);
+    std::atomic<int>  errs(0);
+    for (int t = 0; t < 3; t++) {
+        ths.emplace_back([&stop, &errs, t]() {
+            std::mt19937 rng(t);
+            while (!stop) {
+                nv_ebr::guard g;
+                int i = rng() % nstable;
+                nvchunk* c = NVM::instance().getChunk("reg_s" + std::to_string(i));
+                if (!c || c->offset() != (size_t)i * 64) {
+                    errs++;
+                }
+                c = NVM::instance().getChunk("reg_t" + std::to_string(rng() % 100));
+                if (c && c->size() != 32) {
+                    errs++;
+                }
+            }
+        });
+    }
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 100; i++) {
+            REQUIRE(nvm.mapChunk("reg_t" + std::to_string(i), opened[0], 0, 32) != nullptr);
+        }
+        for (int i = 0; i < 100; i++) {
+            nvm.unmapChunk("reg_t" + std::to_string(i));
+        }
+    }
+    stop = true;
+    for (auto & th : ths) {
+        th.join();
+    }
+    REQUIRE(errs == 0);
+    REQUIRE(nvm.nchunks() == nstable + 1);
+
+    nvm.clear();
+    REQUIRE(nvm.nchunks() == 0);
+    REQUIRE(nvm.ndevs() == 0);
+    unlink("/tmp/dev_reg");
+}
+
+TEST_CASE("nvchunkTest30", "[resolve]") {
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    nvchunk* pa = nvm.openChunk("res_a", "", 0, MB);
+    REQUIRE(pa != nullptr);
+    char* base = (char*)pa->va();
+    nvchunk* pb = nvm.mapChunk("res_b", pa->dev(), 4096, 8192);
+    nvchunk* pc = nvm.mapChunk("res_c", pa->dev(), 100, 200);
+    REQUIRE(pb != nullptr);
+    REQUIRE(pc != nullptr);
+
+    /* the chunk starting last before the address wins */
+    nv_resolved r = nvm.resolve(base + 50);
+    REQUIRE(r.chunk == pa);
+    REQUIRE(r.offset == 50);
+    r = nvm.resolve(base + 150);
+    REQUIRE(r.chunk == pc);
+    REQUIRE(r.offset == 50);
+    r = nvm.resolve(base + 300);
+    REQUIRE(r.chunk == pa);
+    REQUIRE(r.offset == 300);
+    r = nvm.resolve(base + 5000);
+    REQUIRE(r.chunk == pb);
+    REQUIRE(r.offset == 904);
+    r = nvm.resolve(base + MB - 1);
+    REQUIRE(r.chunk == pa);
+    REQUIRE(r.offset == MB - 1);
+    REQUIRE(nvm.resolve(base + MB).chunk == nullptr);
+    REQUIRE(nvm.resolve(nullptr).chunk == nullptr);
+    REQUIRE(nvm.resolve(&r).chunk == nullptr);
+
+    /* unmapped chunks contain no address */
+    nvm.unmapChunk((void*)(base + 100));
+    REQUIRE(nvm.getChunk("res_c") == nullptr);
+    REQUIRE(nvm.resolve(base + 150).chunk == pa);
+    nvm.unmapChunk((void*)(base + 101));
+    REQUIRE(nvm.nchunks() == 2);
+    nvm.unmapChunk("res_a");
+    REQUIRE(nvm.resolve(base + 50).chunk == nullptr);
+    REQUIRE(nvm.resolve(base + 5000).chunk == pb);
+
+    /* a chunk freed and reallocated at the same address before the
+       next lookup is still found */
+    nv_dev* pd = nv_dev::open("", 64 * KB);
+    REQUIRE(pd != nullptr);
+    nv_addrindex & ai = nv_addrindex::instance();
+    int tags[2];
+    nvchunk* f0 = (nvchunk*)&tags[0];
+    nvchunk* f1 = (nvchunk*)&tags[1];
+    ai.add(f0, pd, 0, 4096);
+    ai.add(f1, pd, 4096, 4096);
+    REQUIRE(ai.find((char*)pd->va() + 10).chunk == f0);
+    ai.remove(f0, pd, 0);
+    ai.add(f0, pd, 8192, 4096);
+    REQUIRE(ai.find((char*)pd->va() + 10).chunk == nullptr);
+    r = ai.find((char*)pd->va() + 8200);
+    REQUIRE(r.chunk == f0);
+    REQUIRE(r.offset == 8);
+    ai.remove(f0, pd, 8192);
+    ai.remove(f1, pd, 4096);
+    REQUIRE(ai.find((char*)pd->va() + 4100).chunk == nullptr);
+    delete pd;
+
+    /* lazy devices are resolved where they are mapped now */
+    nv_lazymap & lm = nv_lazymap::instance();
+    nv_devopts opts;
+    opts.lazy = true;
+    unlink("/tmp/dev_res0");
+    unlink("/tmp/dev_res1");
+    nvchunk* pl0 = nvm.openChunk("res_l0", "/tmp/dev_res0", 0, 64 * KB, opts);
+    nvchunk* pl1 = nvm.openChunk("res_l1", "/tmp/dev_res1", 0, 64 * KB, opts);
+    REQUIRE(pl0 != nullptr);
+    REQUIRE(pl1 != nullptr);
+    REQUIRE(!pl0->dev()->is_mapped());
+    char* l0 = (char*)pl0->va();
+    r = nvm.resolve(l0 + 10);
+    REQUIRE(r.chunk == pl0);
+    REQUIRE(r.offset == 10);
+    lm.set_budget(1);
+    char* l1 = (char*)pl1->va();
+    REQUIRE(!pl0->dev()->is_mapped());
+    REQUIRE(nvm.resolve(l1 + 20).chunk == pl1);
+    if (l0 != l1) {
+        REQUIRE(nvm.resolve(l0 + 10).chunk == nullptr);
+    }
+    l0 = (char*)pl0->va();
+    REQUIRE(nvm.resolve(l0 + 10).chunk == pl0);
+    lm.set_budget(0);
+    REQUIRE(!pl1->dev()->is_mapped());
+    REQUIRE(nvm.resolve(l1 + 20).chunk == nullptr);
+
+    /* addresses resolve while other chunks come and go */
+    std::atomic<bool> stop(false);
+    std::atomic<int>  errs(0);
+    std::vector<std::thread> ths;
+    for (int t = 0; t < 3; t++) {
+        ths.emplace_back([&, t]() {
+            std::mt19937 rng(t);
+            while (!stop) {
+                size_t o = 4096 + rng() % 8192;
+                nv_resolved x = NVM::instance().resolve(base + o);
+                if (x.chunk != pb || x.offset != o - 4096) {
+                    errs++;
+                }
+            }
+        });
+    }
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 50; i++) {
+            REQUIRE(nvm.mapChunk("res_t" + std::to_string(i), pb->dev(), 
+                                 16384 + i * 64, 64) != nullptr);
+        }
+        for (int i = 0; i < 50; i++) {
+            nvm.unmapChunk("res_t" + std::to_string(i));
+        }
+    }
+    stop = true;
+    for (auto & th : ths) {
+        th.join();
+    }
+    REQUIRE(errs == 0);
+
+    nvm.clear();
+    REQUIRE(nv_addrindex::instance().nchunks() == 0);
+    REQUIRE(nvm.resolve(base + 5000).chunk == nullptr);
+    unlink("/tmp/dev_res0");
+    unlink("/tmp/dev_res1");
+}
+
+static bool file_mapped(const string & path) {
+    ifstream maps("/proc/self/maps");
+    string line;
+    while (getline(maps, line)) {
+        if (line.size() >= path.size() && 
+            line.compare(line.size() - path.size(), path.size(), path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TEST_CASE("nvchunkTest31", "[refcount]") {
+    string path = "/tmp/dev_refcount";
+    unlink(path.c_str());
+    NVM & nvm = NVM::instance();
+    nvm.clear();
+
+    /* the opener and each chunk hold a reference */
+    nvchunk* pa = nvm.openChunk("rc_a", path, 0, MB);
+    REQUIRE(pa != nullptr);
+    nv_dev* pd = pa->dev();
+    REQUIRE(pd->refs() == 2);
+    nvchunk* pb = nvm.mapChunk("rc_b", pd, MB / 2, MB / 2);
+    REQUIRE(pb != nullptr);
+    REQUIRE(pd->refs() == 3);
+    REQUIRE(nvm.mapChunk("rc_a", pd, 0, 100) == nullptr);
+    REQUIRE(pd->refs() == 3);
+
+    /* closing a device its chunks still use keeps it mapped for them */
+    nvm.closeDev(path);
+    REQUIRE(nvm.getDev(path) == nullptr);
+    REQUIRE(pd->refs() == 2);
+    REQUIRE(pd->is_mapped());
+    REQUIRE(file_mapped(path));
+    strcpy((char*)pa->va() + 10, "still mapped");
+    REQUIRE(0 == pa->flush());
+    REQUIRE(nvm.resolve((char*)pb->va() + 1).chunk == pb);
+
+    nvm.unmapChunk("rc_a");
+    nv_ebr::instance().synchronize();
+    REQUIRE(pd->refs() == 1);
+    REQUIRE(file_mapped(path));
+
+    /* the last chunk unmapped under a reader: the reader never blocks,
+       and the device is unmapped once it leaves */
+    {
+        nv_ebr::guard g;
+        nvchunk* pc = nvm.getChunk("rc_b");
+        REQUIRE(pc == pb);
+        nvm.unmapChunk("rc_b");
+        REQUIRE(nvm.getChunk("rc_b") == nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        REQUIRE(file_mapped(path));
+        REQUIRE(pc->size() == MB / 2);
+        REQUIRE(string((char*)pc->dev()->va() + 10) == "still mapped");
+    }
+    /* frees the chunk, which retires the device, then the device */
+    nv_ebr::instance().synchronize();
+    nv_ebr::instance().synchronize();
+    REQUIRE(!file_mapped(path));
+
+    /* a device closed by another thread between its lookup and the
+       chunk's reference isn't revived */
+    {
+        nv_ebr::guard g;
+        nv_dev* pz = nvm.openDev(path, MB);
+        REQUIRE(pz != nullptr);
+        nvm.closeDev(path);
+        REQUIRE(pz->refs() == 0);
+        REQUIRE(!pz->get());
+        REQUIRE(nvm.mapChunk("rc_z", pz, 0, MB) == nullptr);
+        REQUIRE(errno == ENODEV);
+        REQUIRE(nvm.getChunk("rc_z") == nullptr);
+        REQUIRE(pz->refs() == 0);
+    }
+    nv_ebr::instance().synchronize();
+    nv_ebr::instance().synchronize();
+    REQUIRE(!file_mapped(path));
+
+    /* readers on many threads while chunks and devices come and go */
+    std::atomic<bool> stop(false);
+    std::atomic<int>  errs(0);
+    std::vector<std::thread> ths;
+    for (int t = 0; t < 3; t++) {
+        ths.emplace_back([&stop, &errs]() {
+            while (!stop) {
+                nv_ebr::guard g;
+                nvchunk* c = NVM::instance().getChunk("rc_churn");
+                /* readable, written or not yet */
+                char v = c ? __atomic_load_n((char*)c->va(), __ATOMIC_RELAXED) : 'x';
+                if (v != 'x' && v != 0) {
+                    errs++;
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++) {
+        nvchunk* c = nvm.openChunk("rc_churn", "", 0, 64 * KB);
+        REQUIRE(c != nullptr);
+        __atomic_store_n((char*)c->va(), 'x', __ATOMIC_RELAXED);
+        nvm.closeDev(c->dev()->name());
+        nvm.unmapChunk("rc_churn");
+    }
+    stop = true;
+    for (auto & th : ths) {
+        th.join();
+    }
+    REQUIRE(errs == 0);
+    REQUIRE(nvm.ndevs() == 0);
+
+    nvm.clear();
+    unlink(path.c_str());
+}